@@ -1,2 +1,8 @@
 TEMPLATE = subdirs
 SUBDIRS += src
+
+# The benchmarks and latency tests build the plugin sources again, and need
+# QtTest and dbus-daemon, so they are only built with qmake CONFIG+=tests
+tests {
+    SUBDIRS += tests
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2016 Canonical, Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "contextmenupool.h"
+#include "gmenumodelexporter.h"
+#include "menuregistrar.h"
+#include "logging.h"
+
+namespace {
+
+int poolCapacity() {
+    bool ok;
+    const int value = qEnvironmentVariableIntValue("QTUNITY_CONTEXT_MENU_POOL", &ok);
+    return ok && value >= 0 ? value : 2;
+}
+
+} // namespace
+
+UnityContextMenuPool *UnityContextMenuPool::instance()
+{
+    static UnityContextMenuPool* pool(new UnityContextMenuPool());
+    return pool;
+}
+
+UnityContextMenuPool::UnityContextMenuPool()
+    : m_capacity(poolCapacity())
+{
+}
+
+UnityContextMenuPool::Export UnityContextMenuPool::take(UnityPlatformMenu *menu)
+{
+    if (m_idle.isEmpty()) return Export();
+
+    Export warm = m_idle.takeLast();
+    qCDebug(unityappmenu, "Reusing the context menu export on %s", qPrintable(warm.exporter->menuPath()));
+    warm.exporter->setMenu(menu);
+    return warm;
+}
+
+void UnityContextMenuPool::recycle(const Export &warm)
+{
+    if (!warm.exporter) return;
+
+    // An idle export is never advertised to the shell
+    if (warm.registrar) {
+        warm.registrar->unregisterMenu();
+    }
+    warm.exporter->setMenu(nullptr);
+    m_idle.append(warm);
+    while (m_idle.count() > m_capacity) {
+        drop(m_idle.takeFirst());
+    }
+}
+
+void UnityContextMenuPool::drop(const Export &warm)
+{
+    // Unregisters and unexports
+    delete warm.registrar;
+    delete warm.exporter;
+}
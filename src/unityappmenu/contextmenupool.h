@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2016 Canonical, Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UNITY_CONTEXT_MENU_POOL_H
+#define UNITY_CONTEXT_MENU_POOL_H
+
+#include <QList>
+
+class UnityMenuExporter;
+class UnityMenuRegistrar;
+class UnityPlatformMenu;
+
+// Context menu exports kept warm once their menu is gone: the exported path,
+// models and action group, along with their registrar. Idle exports are not
+// registered for any window. The next context menu shown takes one over and
+// only swaps its contents. At most QTUNITY_CONTEXT_MENU_POOL exports
+// (2 by default) are kept idle.
+class UnityContextMenuPool
+{
+public:
+    struct Export {
+        UnityMenuExporter *exporter = nullptr;
+        UnityMenuRegistrar *registrar = nullptr;
+    };
+
+    static UnityContextMenuPool *instance();
+
+    // An idle export now showing the menu, with a null exporter if there's none
+    Export take(UnityPlatformMenu *menu);
+    // Keep the export of a menu going away, or drop it if the pool is full
+    void recycle(const Export &warm);
+
+private:
+    UnityContextMenuPool();
+    Q_DISABLE_COPY(UnityContextMenuPool)
+
+    void drop(const Export &warm);
+
+    int m_capacity;
+    QList<Export> m_idle;
+};
+
+#endif // UNITY_CONTEXT_MENU_POOL_H
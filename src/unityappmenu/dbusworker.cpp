@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2016 Canonical, Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "dbusworker.h"
+#include "logging.h"
+
+#include <QSemaphore>
+
+namespace {
+
+bool useDBusWorker() {
+    QByteArray dbusThread = qgetenv("QTUNITY_DBUS_THREAD");
+    return !dbusThread.isEmpty() && dbusThread.at(0) != '0';
+}
+
+UnityDBusWorker *createWorker()
+{
+    if (!useDBusWorker()) return nullptr;
+
+    qCDebug(unityappmenu, "Serving menus from a dbus worker thread");
+    return new UnityDBusWorker();
+}
+
+gboolean invoke_cb(gpointer user_data)
+{
+    (*static_cast<std::function<void()>*>(user_data))();
+    return G_SOURCE_REMOVE;
+}
+
+void destroy_cb(gpointer user_data)
+{
+    delete static_cast<std::function<void()>*>(user_data);
+}
+
+} // namespace
+
+UnityDBusWorker *UnityDBusWorker::instance()
+{
+    // Never destroyed, the thread runs as long as the process
+    static UnityDBusWorker* worker(createWorker());
+    return worker;
+}
+
+UnityDBusWorker::UnityDBusWorker()
+    : m_context(g_main_context_new())
+    , m_loop(g_main_loop_new(m_context, FALSE))
+{
+    setObjectName(QStringLiteral("QtUnityDBus"));
+    start();
+}
+
+UnityDBusWorker::~UnityDBusWorker()
+{
+    // Quit from the worker itself, after what was queued before, then join it
+    GMainLoop *loop = m_loop;
+    invoke([loop]() {
+        g_main_loop_quit(loop);
+    });
+    wait();
+
+    g_main_loop_unref(m_loop);
+    g_main_context_unref(m_context);
+}
+
+void UnityDBusWorker::run()
+{
+    // Exports made from the worker are dispatched in its context
+    g_main_context_push_thread_default(m_context);
+    g_main_loop_run(m_loop);
+    g_main_context_pop_thread_default(m_context);
+}
+
+void UnityDBusWorker::invoke(std::function<void()> function)
+{
+    GSource *source = g_idle_source_new();
+    g_source_set_callback(source, invoke_cb, new std::function<void()>(function), destroy_cb);
+    g_source_attach(source, m_context);
+    g_source_unref(source);
+}
+
+void UnityDBusWorker::invokeAndWait(std::function<void()> function)
+{
+    if (QThread::currentThread() == this) {
+        function();
+        return;
+    }
+
+    QSemaphore done;
+    invoke([&function, &done]() {
+        function();
+        done.release();
+    });
+    done.acquire();
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2016 Canonical, Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UNITY_DBUS_WORKER_H
+#define UNITY_DBUS_WORKER_H
+
+#include <QThread>
+
+#include <gio/gio.h>
+
+#include <functional>
+
+// Thread running its own GMainContext, so that what is exported from it on
+// dbus is served while the GUI thread is busy.
+// The worker of the process is only created when QTUNITY_DBUS_THREAD is set,
+// instance() is null otherwise. The tests run others for the processes they
+// stand in for.
+class UnityDBusWorker : public QThread
+{
+    Q_OBJECT
+public:
+    static UnityDBusWorker *instance();
+
+    // Started right away, the destructor quits and joins it
+    UnityDBusWorker();
+    ~UnityDBusWorker();
+
+    GMainContext *context() const { return m_context; }
+
+    // Run a function in the worker context, after the ones invoked before it.
+    void invoke(std::function<void()> function);
+    // Same, blocking until the function returned.
+    void invokeAndWait(std::function<void()> function);
+
+protected:
+    void run() override;
+
+private:
+    GMainContext *m_context;
+    GMainLoop *m_loop;
+};
+
+#endif // UNITY_DBUS_WORKER_H
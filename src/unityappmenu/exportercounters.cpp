@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2016 Canonical, Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "exportercounters.h"
+
+namespace {
+
+const char *const counterNames[UnityExporterCounters::CounterCount] = {
+    "rebuilds",
+    "reloads",
+    "items-created",
+    "items-destroyed",
+    "actions-created",
+    "actions-destroyed",
+    "property-connections",
+    "about-to-show",
+    "activations",
+    "submenu-items-time-us",
+    "icons-encoded"
+};
+
+} // namespace
+
+UnityExporterCounters::UnityExporterCounters()
+{
+    for (int i = 0; i < CounterCount; ++i) {
+        m_values[i] = 0;
+    }
+}
+
+UnityExporterCounters *UnityExporterCounters::process()
+{
+    static UnityExporterCounters* counters(new UnityExporterCounters());
+    return counters;
+}
+
+GVariant *UnityExporterCounters::toVariant() const
+{
+    GVariantBuilder builder;
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a{sx}"));
+    for (int i = 0; i < CounterCount; ++i) {
+        g_variant_builder_add(&builder, "{sx}", counterNames[i], gint64(m_values[i]));
+    }
+    return g_variant_builder_end(&builder);
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2016 Canonical, Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UNITY_EXPORTER_COUNTERS_H
+#define UNITY_EXPORTER_COUNTERS_H
+
+#include <QtGlobal>
+
+#include <atomic>
+
+#include <gio/gio.h>
+
+// Counters of the work done by a menu exporter.
+// They are updated from the GUI thread and can be sampled from any thread,
+// the dbus worker included.
+class UnityExporterCounters
+{
+public:
+    enum Counter {
+        Rebuilds,            // models populated from scratch
+        Reloads,             // populated models updated after a structure change
+        ItemsCreated,
+        ItemsDestroyed,
+        ActionsCreated,
+        ActionsDestroyed,
+        PropertyConnections, // connections to item and menu signals currently alive
+        AboutToShow,
+        Activations,
+        SubmenuItemsTime,    // time spent in addSubmenuItems, in µs
+        IconsEncoded,        // icons rasterized to PNG, for the process only
+        CounterCount
+    };
+
+    UnityExporterCounters();
+
+    // Aggregate of all the exporters of the process
+    static UnityExporterCounters *process();
+
+    void add(Counter counter, qint64 value = 1) { m_values[counter] += value; }
+    qint64 value(Counter counter) const { return m_values[counter]; }
+
+    // The counters by name, as a{sx}
+    GVariant *toVariant() const;
+
+private:
+    Q_DISABLE_COPY(UnityExporterCounters)
+
+    std::atomic<qint64> m_values[CounterCount];
+};
+
+#endif // UNITY_EXPORTER_COUNTERS_H
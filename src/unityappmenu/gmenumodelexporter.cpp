@@ -17,42 +17,66 @@
 // Local
 #include "gmenumodelexporter.h"
 #include "registry.h"
+#include "sessionbus.h"
+#include "dbusworker.h"
+#include "menusnapshot.h"
+#include "updatescheduler.h"
+#include "iconcache.h"
 #include "logging.h"
 #include "qtunityextraactionhandler.h"
+#include "tracepoints.h"
 
 #include <QDebug>
-#include <QTimerEvent>
-
-#include <functional>
+#include <QElapsedTimer>
+#include <QThread>
 
 namespace {
 
-// Derive an action name from the label by removing spaces and Capitilizing the words.
-// Also remove mnemonics from the label.
-inline QString getActionString(QString label)
-{
-    QRegExp re("\\W");
-    label = label.replace(QRegExp("(&|_)"), "");
+// Only build the contents of a submenu once the shell is about to show it
+bool useLazySubmenus() {
+    QByteArray lazyMenus = qgetenv("QTUNITY_LAZY_MENUS");
+    return !lazyMenus.isEmpty() && lazyMenus.at(0) != '0';
+}
 
-#if QT_VERSION >= QT_VERSION_CHECK(5, 14, 0)
-    QStringList parts = label.split(re, Qt::SkipEmptyParts);
-#else
-    QStringList parts = label.split(re, QString::SkipEmptyParts);
-#endif
+// Menus have no icon size of their own
+const int defaultIconSize = 16;
 
-    QString result;
-    Q_FOREACH(const QString& part, parts) {
-        result += part[0].toUpper();
-        result += part.right(part.length()-1);
+// Signals of a watched item and of a watched menu the exporter listens to
+const int itemConnectionCount = 6;
+const int menuConnectionCount = 5;
+
+void insertIcon(GHashTable *attributes, const QIcon &icon, int size)
+{
+    GVariant *serialized = UnityIconCache::instance()->serializedIcon(icon, size);
+    if (serialized) {
+        g_hash_table_insert(attributes, const_cast<char*>(G_MENU_ATTRIBUTE_ICON), serialized);
     }
-    return result;
 }
 
 static void activate_cb(GSimpleAction *action, GVariant *, gpointer user_data)
 {
-    qCDebug(unityappmenu, "Activate menu action '%s'", g_action_get_name(G_ACTION(action)));
-    auto item = static_cast<UnityPlatformMenuItem*>(user_data);
-    item->activated();
+    auto exporter = static_cast<UnityGMenuModelExporter*>(user_data);
+    exporter->activateAction(g_action_get_name(G_ACTION(action)));
+}
+
+static void snapshot_items_changed_cb(GMenuModel *model, gint, gint, gint, gpointer user_data)
+{
+    static_cast<UnityGMenuModelExporter*>(user_data)->snapshotModelChanged(model);
+}
+
+static void snapshot_action_cb(GActionGroup *, const gchar *name, gpointer user_data)
+{
+    static_cast<UnityGMenuModelExporter*>(user_data)->snapshotActionChanged(name);
+}
+
+static void snapshot_action_enabled_cb(GActionGroup *, const gchar *name, gboolean, gpointer user_data)
+{
+    static_cast<UnityGMenuModelExporter*>(user_data)->snapshotActionChanged(name);
+}
+
+static void snapshot_action_state_cb(GActionGroup *, const gchar *name, GVariant *, gpointer user_data)
+{
+    static_cast<UnityGMenuModelExporter*>(user_data)->snapshotActionChanged(name);
 }
 
 static uint s_menuId = 0;
@@ -64,29 +88,12 @@ static uint s_menuId = 0;
 
 UnityMenuBarExporter::UnityMenuBarExporter(UnityPlatformMenuBar * bar)
     : UnityGMenuModelExporter(bar)
+    , m_bar(bar)
 {
     qCDebug(unityappmenu, "UnityMenuBarExporter::UnityMenuBarExporter");
 
-    connect(bar, &UnityPlatformMenuBar::structureChanged, this, [this]() {
-        m_structureTimer.start();
-    });
-    connect(&m_structureTimer, &QTimer::timeout, this, [this, bar]() {
-        clear();
-        Q_FOREACH(QPlatformMenu *platformMenu, bar->menus()) {
-            GMenuItem* item = createSubmenu(platformMenu, nullptr);
-            if (item) {
-                g_menu_append_item(m_gmainMenu, item);
-                g_object_unref(item);
-            }
-
-            UnityPlatformMenu* gplatformMenu = static_cast<UnityPlatformMenu*>(platformMenu);
-            if (gplatformMenu) {
-                // Sadly we don't have a better way to propagate a enabled change in a top level menu
-                // than reseting the whole menubar
-                connect(gplatformMenu, &UnityPlatformMenu::enabledChanged, bar, &UnityPlatformMenuBar::structureChanged);
-            }
-        }
-    });
+    connect(bar, &UnityPlatformMenuBar::menuInserted, this, &UnityMenuBarExporter::insertMenu);
+    connect(bar, &UnityPlatformMenuBar::menuRemoved, this, &UnityMenuBarExporter::removeMenu);
 
     connect(bar, &UnityPlatformMenuBar::ready, this, [this]() {
         exportModels();
@@ -98,19 +105,112 @@ UnityMenuBarExporter::~UnityMenuBarExporter()
     qCDebug(unityappmenu, "UnityMenuBarExporter::~UnityMenuBarExporter");
 }
 
+// The main menu of the bar exports the top level menus as submenu entries.
+int UnityMenuBarExporter::itemCount(UnityMenuModel *model)
+{
+    if (model != m_mainModel) return UnityGMenuModelExporter::itemCount(model);
+    return m_exportedMenus.count();
+}
+
+void UnityMenuBarExporter::itemAttributes(UnityMenuModel *model, int position, GHashTable *attributes)
+{
+    if (model != m_mainModel) {
+        UnityGMenuModelExporter::itemAttributes(model, position, attributes);
+        return;
+    }
+    if (position < 0 || position >= m_exportedMenus.count()) return;
+
+    menuAttributes(m_exportedMenus.at(position), attributes);
+}
+
+void UnityMenuBarExporter::itemLinks(UnityMenuModel *model, int position, GHashTable *links)
+{
+    if (model != m_mainModel) {
+        UnityGMenuModelExporter::itemLinks(model, position, links);
+        return;
+    }
+    if (position < 0 || position >= m_exportedMenus.count()) return;
+
+    UnityMenuModel *submenu = m_modelsForMenus.value(m_exportedMenus.at(position));
+    if (submenu) {
+        g_hash_table_insert(links, const_cast<char*>(G_MENU_LINK_SUBMENU), g_object_ref(submenu));
+    }
+}
+
+// Splice a newly inserted top level menu into the main menu,
+// leaving the other top level menus untouched.
+void UnityMenuBarExporter::insertMenu(QPlatformMenu *platformMenu)
+{
+    UnityPlatformMenu* gplatformMenu = static_cast<UnityPlatformMenu*>(platformMenu);
+    if (!gplatformMenu || m_exportedMenus.contains(gplatformMenu)) return;
+
+    // The menu is placed after the exported menus that precede it in the bar
+    int position = 0;
+    bool found = false;
+    Q_FOREACH(QPlatformMenu *menu, m_bar->menus()) {
+        if (menu == platformMenu) {
+            found = true;
+            break;
+        }
+        if (m_exportedMenus.contains(static_cast<UnityPlatformMenu*>(menu))) {
+            ++position;
+        }
+    }
+    if (!found) return;
+
+    exportSubmenu(gplatformMenu);
+    m_exportedMenus.insert(position, gplatformMenu);
+    g_menu_model_items_changed(G_MENU_MODEL(m_mainModel), position, 0, 1);
+}
+
+// Remove a top level menu from the main menu and release its submenu.
+void UnityMenuBarExporter::removeMenu(QPlatformMenu *platformMenu)
+{
+    UnityPlatformMenu* gplatformMenu = static_cast<UnityPlatformMenu*>(platformMenu);
+    const int position = m_exportedMenus.indexOf(gplatformMenu);
+    if (position < 0) return;
+
+    m_exportedMenus.remove(position);
+    m_dirtyMenus.remove(gplatformMenu);
+    g_menu_model_items_changed(G_MENU_MODEL(m_mainModel), position, 1, 0);
+    releaseMenu(gplatformMenu);
+}
+
+// Queue the entry of a top level menu for replacement, along with the patched
+// items, so that changes made together are announced once. A change only
+// replaces the entry of the menu in the menubar.
+void UnityMenuBarExporter::menuEntryChanged(UnityPlatformMenu *gplatformMenu)
+{
+    if (!m_exportedMenus.contains(gplatformMenu)) return;
+
+    m_dirtyMenus.insert(gplatformMenu);
+    m_propertyTimer.start();
+}
+
+// Replace the entries of the changed top level menus, keeping their exported
+// submenus, then patch the changed items.
+void UnityMenuBarExporter::patchItems()
+{
+    const QSet<UnityPlatformMenu*> menus = m_dirtyMenus;
+    m_dirtyMenus.clear();
+
+    Q_FOREACH(UnityPlatformMenu *gplatformMenu, menus) {
+        const int position = m_exportedMenus.indexOf(gplatformMenu);
+        if (position >= 0) {
+            g_menu_model_items_changed(G_MENU_MODEL(m_mainModel), position, 1, 1);
+        }
+    }
+    UnityGMenuModelExporter::patchItems();
+}
+
 UnityMenuExporter::UnityMenuExporter(UnityPlatformMenu *menu)
     : UnityGMenuModelExporter(menu)
+    , m_menu(menu)
 {
     qCDebug(unityappmenu, "UnityMenuExporter::UnityMenuExporter");
 
-    connect(menu, &UnityPlatformMenu::structureChanged, this, [this]() {
-        m_structureTimer.start();
-    });
-    connect(&m_structureTimer, &QTimer::timeout, this, [this, menu]() {
-        clear();
-        addSubmenuItems(menu, m_gmainMenu);
-    });
-    addSubmenuItems(menu, m_gmainMenu);
+    watchMenu(menu);
+    addSubmenuItems(menu, m_mainModel);
 }
 
 UnityMenuExporter::~UnityMenuExporter()
@@ -118,100 +218,178 @@ UnityMenuExporter::~UnityMenuExporter()
     qCDebug(unityappmenu, "UnityMenuExporter::~UnityMenuExporter");
 }
 
+// Export another menu on the same path, models and action group, used by the
+// context menu pool. The entries of the main menu are swapped in place; without
+// a menu, the exporter is left empty and owned by nobody.
+void UnityMenuExporter::setMenu(UnityPlatformMenu *menu)
+{
+    if (menu == m_menu) return;
+
+    if (m_menu) {
+        UnityMenuUpdateScheduler::instance()->cancel(this, m_menu);
+    }
+    m_menu = menu;
+    setParent(menu);
+
+    if (menu) {
+        watchMenu(menu);
+        addSubmenuItems(menu, m_mainModel);
+    } else {
+        QSet<UnityPlatformMenuItem*> items;
+        collectItems(m_mainModel, items);
+        updateEntries(m_mainModel, QVector<UnityPlatformMenuItem*>(), MenuLayout(), true);
+        Q_FOREACH(UnityPlatformMenuItem *item, items) {
+            releaseItem(item);
+        }
+    }
+}
+
+UnityMenuModel *UnityMenuExporter::menuModel(UnityPlatformMenu *gplatformMenu) const
+{
+    return gplatformMenu == m_menu ? m_mainModel : UnityGMenuModelExporter::menuModel(gplatformMenu);
+}
+
+// The exported menu itself is the main menu
+void UnityMenuExporter::reloadMenu(UnityPlatformMenu *gplatformMenu)
+{
+    if (gplatformMenu == m_menu) {
+        addSubmenuItems(m_menu, m_mainModel);
+    } else {
+        UnityGMenuModelExporter::reloadMenu(gplatformMenu);
+    }
+}
+
 UnityGMenuModelExporter::UnityGMenuModelExporter(QObject *parent)
     : QObject(parent)
     , m_connection(nullptr)
-    , m_gmainMenu(g_menu_new())
+    , m_mainModel(nullptr)
     , m_gactionGroup(g_simple_action_group_new())
     , m_exportedModel(0)
     , m_exportedActions(0)
     , m_qtunityExtraHandler(nullptr)
     , m_menuPath(QStringLiteral(MENU_OBJECT_PATH).arg(s_menuId++))
+    , m_lazySubmenus(useLazySubmenus())
+    , m_exportRequested(false)
+    , m_snapshotExport(nullptr)
+    , m_submenuItemsDepth(0)
+    , m_nextModelId(1)
 {
-    m_structureTimer.setSingleShot(true);
-    m_structureTimer.setInterval(0);
+    // Served from snapshots in the worker, holding the menus changed since the last one
+    if (UnityDBusWorker::instance()) {
+        m_snapshotTimer.setSingleShot(true);
+        m_snapshotTimer.setInterval(0);
+        connect(&m_snapshotTimer, &QTimer::timeout, this, &UnityGMenuModelExporter::publishSnapshot);
+
+        g_signal_connect(m_gactionGroup, "action-added", G_CALLBACK(snapshot_action_cb), this);
+        g_signal_connect(m_gactionGroup, "action-removed", G_CALLBACK(snapshot_action_cb), this);
+        g_signal_connect(m_gactionGroup, "action-enabled-changed", G_CALLBACK(snapshot_action_enabled_cb), this);
+        g_signal_connect(m_gactionGroup, "action-state-changed", G_CALLBACK(snapshot_action_state_cb), this);
+    }
+    m_mainModel = createModel();
+
+    UnitySessionBus *bus = UnitySessionBus::instance();
+    bus->acquire();
+    connect(bus, &UnitySessionBus::ready, this, [this]() {
+        if (m_exportRequested) {
+            exportOnBus();
+        }
+    });
+
+    m_propertyTimer.setSingleShot(true);
+    m_propertyTimer.setInterval(0);
+    connect(&m_propertyTimer, &QTimer::timeout, this, &UnityGMenuModelExporter::patchItems);
 }
 
 UnityGMenuModelExporter::~UnityGMenuModelExporter()
 {
+    UnityMenuUpdateScheduler::instance()->cancelAll(this);
     unexportModels();
     clear();
 
-    g_object_unref(m_gmainMenu);
+    // The watched objects are disconnected along with the exporter
+    count(UnityExporterCounters::PropertyConnections,
+          -(m_watchedItems.count() * itemConnectionCount + m_watchedMenus.count() * menuConnectionCount));
+
+    releaseModel(m_mainModel);
+    g_signal_handlers_disconnect_by_data(m_gactionGroup, this);
     g_object_unref(m_gactionGroup);
 }
 
 // Clear the menu and actions that have been created.
 void UnityGMenuModelExporter::clear()
 {
-    Q_FOREACH(const QVector<QMetaObject::Connection>& menuPropertyConnections, m_propertyConnections) {
-        Q_FOREACH(const QMetaObject::Connection& connection, menuPropertyConnections) {
-            QObject::disconnect(connection);
-        }
+    Q_FOREACH(UnityPlatformMenuItem *item, m_exportedItems.keys()) {
+        releaseItem(item);
     }
-    m_propertyConnections.clear();
-
-    g_menu_remove_all(m_gmainMenu);
-
-    Q_FOREACH(const QSet<QByteArray>& menuActions, m_actions) {
-        Q_FOREACH(const QByteArray& action, menuActions) {
-            g_action_map_remove_action(G_ACTION_MAP(m_gactionGroup), action.constData());
-        }
+    Q_FOREACH(UnityPlatformMenu *gplatformMenu, m_modelsForMenus.keys()) {
+        releaseMenu(gplatformMenu);
     }
-    m_actions.clear();
-
-    m_gmenusForMenus.clear();
+    m_menuEntries.clear();
 }
 
-void UnityGMenuModelExporter::timerEvent(QTimerEvent *e)
+// Reload a menu whose structure changed, called by the update scheduler.
+void UnityGMenuModelExporter::reloadMenu(UnityPlatformMenu *gplatformMenu)
 {
-    // Find the menu, it's a very short list
-    auto it = m_reloadMenuTimers.begin();
-    for (; it != m_reloadMenuTimers.end(); ++it) {
-        if (e->timerId() == it.value())
-            break;
+    UnityMenuModel *model = m_modelsForMenus.value(gplatformMenu);
+    if (m_unpopulatedModels.contains(model)) {
+        // Nothing exported yet, it will be built when first read
+    } else if (model) {
+        addSubmenuItems(gplatformMenu, model);
+    } else {
+        qWarning() << "Got an update for a menu that has no model" << gplatformMenu;
     }
+}
 
-    if (it != m_reloadMenuTimers.end()) {
-        UnityPlatformMenu* gplatformMenu = it.key();
-        GMenu *menu = m_gmenusForMenus.value(gplatformMenu);
-        if (menu) {
-            Q_FOREACH(const QMetaObject::Connection& connection, m_propertyConnections[menu]) {
-                QObject::disconnect(connection);
-            }
-            m_propertyConnections.remove(menu);
-            Q_FOREACH(const QByteArray& action, m_actions[menu]) {
-                g_action_map_remove_action(G_ACTION_MAP(m_gactionGroup), action.constData());
-            }
-            m_actions.remove(menu);
-            g_menu_remove_all(menu);
-            addSubmenuItems(gplatformMenu, menu);
-        } else {
-            qWarning() << "Got an update timer for a menu that has no GMenu" << gplatformMenu;
-        }
-
-        m_reloadMenuTimers.erase(it);
-    } else {
-        qWarning() << "Got an update timer for a timer that was not running";
+// Number of menus above a menu, so that the update scheduler reloads parents first.
+int UnityGMenuModelExporter::menuDepth(UnityPlatformMenu *gplatformMenu) const
+{
+    int depth = 0;
+    for (UnityPlatformMenu *parent = m_parentMenus.value(gplatformMenu);
+         parent && depth < m_parentMenus.count();
+         parent = m_parentMenus.value(parent)) {
+        ++depth;
     }
-    killTimer(e->timerId());
+    return depth;
 }
 
-// Export the model on dbus
+// Export the model on dbus.
+// The export is queued until the shared session bus is ready.
 void UnityGMenuModelExporter::exportModels()
 {
-    GError *error = nullptr;
-    m_connection = g_bus_get_sync (G_BUS_TYPE_SESSION, nullptr, &error);
-    if (!m_connection) {
-        qCWarning(unityappmenu, "Failed to retreive session bus - %s", error ? error->message : "unknown error");
-        g_error_free (error);
-        return;
+    m_exportRequested = true;
+    if (UnitySessionBus::instance()->connection()) {
+        exportOnBus();
     }
+}
 
+// Export the model on the acquired session bus
+void UnityGMenuModelExporter::exportOnBus()
+{
+    UNITY_TRACE(export_models_start);
+    GError *error = nullptr;
+    m_connection = UnitySessionBus::instance()->connection();
     QByteArray menuPath(m_menuPath.toUtf8());
 
+    if (UnityDBusWorker::instance()) {
+        if (!m_snapshotExport) {
+            // The first snapshot holds everything, later ones only what changed
+            UnityMenuSnapshotExport *snapshotExport = new UnityMenuSnapshotExport(this);
+            GDBusConnection *connection = m_connection;
+            GVariant *snapshot = this->snapshot();
+            UnityDBusWorker::instance()->invoke([snapshotExport, connection, menuPath, snapshot]() {
+                snapshotExport->apply(snapshot);
+                snapshotExport->exportOn(connection, menuPath);
+                g_variant_unref(snapshot);
+            });
+            m_snapshotExport = snapshotExport;
+            clearSnapshotChanges();
+        }
+        UNITY_TRACE(export_models_end);
+        return;
+    }
+
     if (m_exportedModel == 0) {
-        m_exportedModel = g_dbus_connection_export_menu_model(m_connection, menuPath.constData(), G_MENU_MODEL(m_gmainMenu), &error);
+        m_exportedModel = g_dbus_connection_export_menu_model(m_connection, menuPath.constData(), G_MENU_MODEL(m_mainModel), &error);
         if (m_exportedModel == 0) {
             qCWarning(unityappmenu, "Failed to export menu - %s", error ? error->message : "unknown error");
             g_error_free (error);
@@ -239,25 +417,146 @@ void UnityGMenuModelExporter::exportModels()
             m_qtunityExtraHandler = nullptr;
         }
     }
+    UNITY_TRACE(export_models_end);
 }
 
 void UnityGMenuModelExporter::aboutToShow(quint64 tag)
 {
+    // Called from the dbus worker, the menus can only be touched in the GUI thread
+    if (QThread::currentThread() != thread()) {
+        QMetaObject::invokeMethod(this, "aboutToShow", Qt::QueuedConnection, Q_ARG(quint64, tag));
+        return;
+    }
+
     UnityPlatformMenu* gplatformMenu = m_submenusWithTag.value(tag);
     if (!gplatformMenu) {
         qWarning() << "Got an aboutToShow call with an unknown tag";
         return;
     }
+    count(UnityExporterCounters::AboutToShow);
+
+    // Build a lazy submenu before Qt gets the chance to update it
+    UnityMenuModel *model = m_modelsForMenus.value(gplatformMenu);
+    if (model && m_unpopulatedModels.remove(model)) {
+        addSubmenuItems(gplatformMenu, model);
+    }
 
     gplatformMenu->aboutToShow();
 }
 
+// Activate the item of an exported action.
+void UnityGMenuModelExporter::activateAction(const QByteArray &name)
+{
+    UnityPlatformMenuItem *item = m_itemsForActions.value(name);
+    if (!item) return;
+
+    qCDebug(unityappmenu, "Activate menu action '%s'", name.constData());
+    count(UnityExporterCounters::Activations);
+    UNITY_TRACE1(activate_start, quint64(item->tag()));
+    item->activated();
+    UNITY_TRACE1(activate_end, quint64(item->tag()));
+}
+
+void UnityGMenuModelExporter::count(UnityExporterCounters::Counter counter, qint64 value)
+{
+    m_counters.add(counter, value);
+    UnityExporterCounters::process()->add(counter, value);
+}
+
+void UnityGMenuModelExporter::snapshotModelChanged(GMenuModel *model)
+{
+    if (m_snapshotExport) {
+        m_snapshotModels.insert(UNITY_MENU_MODEL(model));
+        m_snapshotTimer.start();
+    }
+}
+
+void UnityGMenuModelExporter::snapshotActionChanged(const gchar *name)
+{
+    if (m_snapshotExport) {
+        m_snapshotActions.insert(QByteArray(name));
+        m_snapshotTimer.start();
+    }
+}
+
+guint64 UnityGMenuModelExporter::modelId(GMenuModel *model) const
+{
+    return m_modelIds.value(UNITY_MENU_MODEL(model));
+}
+
+GVariant *UnityGMenuModelExporter::snapshot()
+{
+    UnityMenuSnapshotBuilder builder(modelId(G_MENU_MODEL(m_mainModel)),
+                                     [this](GMenuModel *model) { return modelId(model); });
+
+    // Lazy submenus nobody opened yet are left empty, reading them would build them
+    Q_FOREACH(UnityMenuModel *model, m_modelIds.keys()) {
+        if (!m_unpopulatedModels.contains(model)) {
+            builder.addModel(G_MENU_MODEL(model));
+        }
+    }
+
+    gchar **names = g_action_group_list_actions(G_ACTION_GROUP(m_gactionGroup));
+    for (gchar **name = names; *name; ++name) {
+        builder.addAction(G_ACTION_GROUP(m_gactionGroup), *name);
+    }
+    g_strfreev(names);
+
+    return builder.end();
+}
+
+void UnityGMenuModelExporter::clearSnapshotChanges()
+{
+    m_snapshotModels.clear();
+    m_snapshotReleasedModels.clear();
+    m_snapshotActions.clear();
+}
+
+// Hand the worker the models and actions changed since the last snapshot.
+void UnityGMenuModelExporter::publishSnapshot()
+{
+    if (!m_snapshotExport) return;
+
+    UnityMenuSnapshotBuilder builder(modelId(G_MENU_MODEL(m_mainModel)),
+                                     [this](GMenuModel *model) { return modelId(model); });
+    Q_FOREACH(guint64 id, m_snapshotReleasedModels) {
+        builder.addReleasedModel(id);
+    }
+    Q_FOREACH(UnityMenuModel *model, m_snapshotModels) {
+        if (!m_unpopulatedModels.contains(model)) {
+            builder.addModel(G_MENU_MODEL(model));
+        }
+    }
+    Q_FOREACH(const QByteArray &name, m_snapshotActions) {
+        builder.addAction(G_ACTION_GROUP(m_gactionGroup), name.constData());
+    }
+    clearSnapshotChanges();
+
+    GVariant *snapshot = builder.end();
+    UnityMenuSnapshotExport *snapshotExport = m_snapshotExport;
+    UnityDBusWorker::instance()->invoke([snapshotExport, snapshot]() {
+        snapshotExport->apply(snapshot);
+        g_variant_unref(snapshot);
+    });
+}
+
 // Unexport the model
 void UnityGMenuModelExporter::unexportModels()
 {
-    GError *error = nullptr;
-    if (!m_connection) {
-        qCWarning(unityappmenu, "Failed to retreive session bus - %s", error ? error->message : "unknown error");
+    // Don't export once a pending bus request completes
+    m_exportRequested = false;
+    if (!m_connection) return;
+
+    if (m_snapshotExport) {
+        // Make sure the worker is done with this exporter before it can go away
+        UnityMenuSnapshotExport *snapshotExport = m_snapshotExport;
+        m_snapshotExport = nullptr;
+        m_snapshotTimer.stop();
+        clearSnapshotChanges();
+        UnityDBusWorker::instance()->invokeAndWait([snapshotExport]() {
+            delete snapshotExport;
+        });
+        m_connection = nullptr;
         return;
     }
 
@@ -274,207 +573,746 @@ void UnityGMenuModelExporter::unexportModels()
         delete m_qtunityExtraHandler;
         m_qtunityExtraHandler = nullptr;
     }
-    g_object_unref(m_connection);
     m_connection = nullptr;
 }
 
-// Create a submenu for the given platform menu.
-// Returns a gmenuitem entry for the menu, which must be cleaned up using g_object_unref.
-// If forItem is suplied, use it's label.
-GMenuItem *UnityGMenuModelExporter::createSubmenu(QPlatformMenu *platformMenu, UnityPlatformMenuItem *forItem)
+// Returns the number of entries exported in a model.
+// A lazy submenu is built the first time it is read; nobody listens to its
+// changes yet, so it is populated without emitting items-changed.
+int UnityGMenuModelExporter::itemCount(UnityMenuModel *model)
 {
-    UnityPlatformMenu* gplatformMenu = static_cast<UnityPlatformMenu*>(platformMenu);
-    if (!gplatformMenu) return nullptr;
-    GMenu* menu = g_menu_new();
-
-    m_gmenusForMenus.insert(gplatformMenu, menu);
+    UnityPlatformMenu *gplatformMenu = m_unpopulatedModels.take(model);
+    if (gplatformMenu) {
+        addSubmenuItems(gplatformMenu, model, false);
+    }
+    return m_menuEntries.value(model).count();
+}
 
-    QByteArray label;
-    bool enabled;
-    if (forItem) {
-        label = UnityPlatformMenuItem::get_text(forItem).toUtf8();
-        enabled = UnityPlatformMenuItem::get_enabled(forItem);
+// Fill the attributes of an entry of a model, read live from its platform menu item.
+void UnityGMenuModelExporter::itemAttributes(UnityMenuModel *model, int position, GHashTable *attributes)
+{
+    const QVector<UnityPlatformMenuItem*> entries = m_menuEntries.value(model);
+    if (position < 0 || position >= entries.count()) return;
+
+    UnityPlatformMenuItem *item = entries.at(position);
+    const ExportedItem exported = m_exportedItems.value(item);
+
+    if (exported.separator) {
+        g_hash_table_insert(attributes, const_cast<char*>(G_MENU_ATTRIBUTE_LABEL),
+                            g_variant_ref_sink(g_variant_new_string("")));
+    } else if (exported.submenu) {
+        submenuAttributes(exported.submenu, item->exportedLabel(),
+                          UnityPlatformMenuItem::get_enabled(item), attributes);
+        insertIcon(attributes, UnityPlatformMenuItem::get_icon(item), UnityPlatformMenuItem::get_iconSize(item));
     } else {
-        label = UnityPlatformMenu::get_text(gplatformMenu).toUtf8();
-        enabled = UnityPlatformMenu::get_enabled(gplatformMenu);
+        g_hash_table_insert(attributes, const_cast<char*>(G_MENU_ATTRIBUTE_LABEL),
+                            g_variant_ref_sink(g_variant_new_string(item->exportedLabel().constData())));
+        g_hash_table_insert(attributes, const_cast<char*>("accel"),
+                            g_variant_ref_sink(g_variant_new_string(item->exportedAccel().constData())));
+        g_hash_table_insert(attributes, const_cast<char*>(G_MENU_ATTRIBUTE_ACTION),
+                            g_variant_ref_sink(g_variant_new_string(("unity." + exported.action).constData())));
+        insertIcon(attributes, UnityPlatformMenuItem::get_icon(item), UnityPlatformMenuItem::get_iconSize(item));
     }
+}
 
-    addSubmenuItems(gplatformMenu, menu);
+// Fill the links of an entry of a model: the model of its section or submenu.
+void UnityGMenuModelExporter::itemLinks(UnityMenuModel *model, int position, GHashTable *links)
+{
+    const QVector<UnityPlatformMenuItem*> entries = m_menuEntries.value(model);
+    if (position < 0 || position >= entries.count()) return;
+
+    UnityPlatformMenuItem *item = entries.at(position);
+    const ExportedItem exported = m_exportedItems.value(item);
+
+    UnityMenuModel *section = m_sectionModels.value(item);
+    UnityMenuModel *submenu = exported.submenu ? m_modelsForMenus.value(exported.submenu) : nullptr;
+    if (section) {
+        g_hash_table_insert(links, const_cast<char*>(G_MENU_LINK_SECTION), g_object_ref(section));
+    } else if (submenu) {
+        g_hash_table_insert(links, const_cast<char*>(G_MENU_LINK_SUBMENU), g_object_ref(submenu));
+    }
+}
 
-    Q_FOREACH(QPlatformMenuItem *childItem, gplatformMenu->menuItems()) {
-        UnityPlatformMenuItem* gplatformMenuItem = static_cast<UnityPlatformMenuItem*>(childItem);
-        if (!gplatformMenuItem) continue;
+// Fill the attributes of an entry opening a submenu.
+void UnityGMenuModelExporter::submenuAttributes(UnityPlatformMenu *gplatformMenu, const QByteArray &label, bool enabled, GHashTable *attributes) const
+{
+    g_hash_table_insert(attributes, const_cast<char*>(G_MENU_ATTRIBUTE_LABEL),
+                        g_variant_ref_sink(g_variant_new_string(label.constData())));
 
-        // Sadly we don't have a better way to propagate a enabled change in a item-that-is-submenu
-        // than reseting the whole parent menu
-        if (gplatformMenuItem->menu()) {
-            connect(gplatformMenuItem, &UnityPlatformMenuItem::enabledChanged, gplatformMenu, &UnityPlatformMenu::structureChanged);
-        }
-        connect(gplatformMenuItem, &UnityPlatformMenuItem::visibleChanged, gplatformMenu, &UnityPlatformMenu::structureChanged);
+    const quint64 tag = gplatformMenu->tag();
+    if (tag != 0) {
+        g_hash_table_insert(attributes, const_cast<char*>("qtunity-tag"),
+                            g_variant_ref_sink(g_variant_new_uint64(tag)));
     }
+    g_hash_table_insert(attributes, const_cast<char*>("submenu-enabled"),
+                        g_variant_ref_sink(g_variant_new_boolean(enabled)));
+}
+
+// Fill the attributes of an entry opening a menu that has no item of its own,
+// like the top level menus of a bar.
+void UnityGMenuModelExporter::menuAttributes(UnityPlatformMenu *gplatformMenu, GHashTable *attributes) const
+{
+    submenuAttributes(gplatformMenu,
+                      UnityPlatformMenu::get_text(gplatformMenu).toUtf8(),
+                      UnityPlatformMenu::get_enabled(gplatformMenu),
+                      attributes);
+    insertIcon(attributes, UnityPlatformMenu::get_icon(gplatformMenu), defaultIconSize);
+}
 
-    GMenuItem* gmenuItem = g_menu_item_new_submenu(label.constData(), G_MENU_MODEL(menu));
+// Export the model of a platform menu and return it, the exporter keeps its reference.
+// The model is kept across reloads of the parent, so it is only populated once.
+UnityMenuModel *UnityGMenuModelExporter::exportSubmenu(UnityPlatformMenu *gplatformMenu)
+{
     const quint64 tag = gplatformMenu->tag();
+    UnityMenuModel *model = m_modelsForMenus.value(gplatformMenu);
+    if (!model) {
+        UNITY_TRACE1(export_submenu_start, tag);
+        model = createModel();
+        m_modelsForMenus.insert(gplatformMenu, model);
+
+        // In lazy mode the submenu stays empty until the shell reads it
+        // or asks for it through aboutToShow, which needs its tag.
+        if (m_lazySubmenus && tag != 0) {
+            m_unpopulatedModels.insert(model, gplatformMenu);
+        } else {
+            addSubmenuItems(gplatformMenu, model, false);
+        }
+        // Whatever was pending for a previous model of the menu is covered
+        UnityMenuUpdateScheduler::instance()->cancel(this, gplatformMenu);
+
+        watchMenu(gplatformMenu);
+        UNITY_TRACE1(export_submenu_end, tag);
+    }
+
+    // Forget the tag the menu had when last exported, if Qt changed it since
+    const quint64 previousTag = m_submenuTags.value(gplatformMenu);
+    if (previousTag != tag && m_submenusWithTag.value(previousTag) == gplatformMenu) {
+        m_submenusWithTag.remove(previousTag);
+    }
     if (tag != 0) {
-        g_menu_item_set_attribute_value(gmenuItem, "qtunity-tag", g_variant_new_uint64 (tag));
-        m_submenusWithTag.insert(gplatformMenu->tag(), gplatformMenu);
+        m_submenusWithTag.insert(tag, gplatformMenu);
+        m_submenuTags.insert(gplatformMenu, tag);
+    } else {
+        m_submenuTags.remove(gplatformMenu);
     }
-    g_object_unref(menu);
+    return model;
+}
 
-    g_menu_item_set_attribute_value(gmenuItem, "submenu-enabled", g_variant_new_boolean(enabled));
+// Add a platform menu's items to the given model.
+// The items are inserted into menus sections, split by the menu separators.
+// If the model was already populated, only the entries that changed since are
+// inserted or removed; unchanged entries keep their actions and connections.
+// Without notify, no items-changed is emitted: only for models nobody reads yet.
+void UnityGMenuModelExporter::addSubmenuItems(UnityPlatformMenu* gplatformMenu, UnityMenuModel* model, bool notify)
+{
+    // Submenus built along are part of the time spent by the outermost call
+    QElapsedTimer elapsed;
+    if (m_submenuItemsDepth++ == 0) {
+        elapsed.start();
+    }
+    count(m_menuEntries.contains(model) ? UnityExporterCounters::Reloads : UnityExporterCounters::Rebuilds);
+    UNITY_TRACE2(add_submenu_items_start, quint64(gplatformMenu->tag()), notify);
 
-    connect(gplatformMenu, &UnityPlatformMenu::structureChanged, this, [this, gplatformMenu]
-        {
-            if (!m_reloadMenuTimers.contains(gplatformMenu)) {
-                const int timerId = startTimer(0);
-                m_reloadMenuTimers.insert(gplatformMenu, timerId);
-            }
-        });
+    QSet<UnityPlatformMenuItem*> previousItems;
+    collectItems(model, previousItems);
 
-    connect(gplatformMenu, &UnityPlatformMenu::destroyed, this, [this, tag, gplatformMenu]
-        {
-            m_submenusWithTag.remove(tag);
-            m_gmenusForMenus.remove(gplatformMenu);
-            auto timerIdIt = m_reloadMenuTimers.find(gplatformMenu);
-            if (timerIdIt != m_reloadMenuTimers.end()) {
-                killTimer(*timerIdIt);
-                m_reloadMenuTimers.erase(timerIdIt);
-            }
-        });
+    const MenuLayout layout = layoutForMenu(gplatformMenu);
+    updateEntries(model, layout.entries, layout, notify);
 
-    return gmenuItem;
+    QSet<UnityPlatformMenuItem*> currentItems;
+    collectItems(model, currentItems);
+    Q_FOREACH(UnityPlatformMenuItem *item, previousItems) {
+        if (!currentItems.contains(item)) {
+            releaseItem(item);
+        }
+    }
+
+    Q_FOREACH(const UnityMenuItemEntry &entry, gplatformMenu->itemTable()) {
+        if (entry.submenu) {
+            m_parentMenus.insert(entry.submenu, gplatformMenu);
+        }
+
+        m_itemMenus.insert(entry.item, gplatformMenu);
+        // Hidden items too, to be told when they are shown
+        watchItem(entry.item);
+    }
+
+    UNITY_TRACE2(add_submenu_items_end, quint64(gplatformMenu->tag()), notify);
+    if (--m_submenuItemsDepth == 0) {
+        count(UnityExporterCounters::SubmenuItemsTime, elapsed.nsecsElapsed() / 1000);
+    }
 }
 
-// Add a platform menu's items to the given gmenu.
-// The items are inserted into menus sections, split by the menu separators.
-void UnityGMenuModelExporter::addSubmenuItems(UnityPlatformMenu* gplatformMenu, GMenu* menu)
+// Connect the signals of an item to the exporter, once for the lifetime of both.
+// The slots find what was exported for the item from the sender.
+void UnityGMenuModelExporter::watchItem(UnityPlatformMenuItem *item)
+{
+    if (m_watchedItems.contains(item)) return;
+    m_watchedItems.insert(item);
+
+    // The item is only used as a key once destroyed, so keep its typed pointer
+    connect(item, &QObject::destroyed, this, [this, item]() { itemDestroyed(item); });
+    connect(item, &UnityPlatformMenuItem::propertyChanged, this, &UnityGMenuModelExporter::itemPropertyChanged);
+    connect(item, &UnityPlatformMenuItem::checkedChanged, this, &UnityGMenuModelExporter::itemCheckedChanged);
+    connect(item, &UnityPlatformMenuItem::enabledChanged, this, &UnityGMenuModelExporter::itemEnabledChanged);
+    connect(item, &UnityPlatformMenuItem::visibleChanged, this, &UnityGMenuModelExporter::itemVisibleChanged);
+    connect(item, &UnityPlatformMenuItem::separatorChanged, this, &UnityGMenuModelExporter::itemSeparatorChanged);
+    count(UnityExporterCounters::PropertyConnections, itemConnectionCount);
+}
+
+// Connect the signals of a menu to the exporter, once for the lifetime of both.
+void UnityGMenuModelExporter::watchMenu(UnityPlatformMenu *gplatformMenu)
+{
+    if (m_watchedMenus.contains(gplatformMenu)) return;
+    m_watchedMenus.insert(gplatformMenu);
+
+    connect(gplatformMenu, &QObject::destroyed, this, [this, gplatformMenu]() { menuDestroyed(gplatformMenu); });
+    connect(gplatformMenu, &UnityPlatformMenu::menuItemInserted, this, &UnityGMenuModelExporter::menuItemInserted);
+    connect(gplatformMenu, &UnityPlatformMenu::menuItemRemoved, this, &UnityGMenuModelExporter::menuItemRemoved);
+    connect(gplatformMenu, &UnityPlatformMenu::enabledChanged, this, &UnityGMenuModelExporter::menuEnabledChanged);
+    connect(gplatformMenu, &UnityPlatformMenu::propertyChanged, this, &UnityGMenuModelExporter::menuPropertyChanged);
+    count(UnityExporterCounters::PropertyConnections, menuConnectionCount);
+}
+
+// Drop everything exported for a watched item going away.
+void UnityGMenuModelExporter::itemDestroyed(UnityPlatformMenuItem *item)
+{
+    if (!m_watchedItems.remove(item)) return;
+
+    // The items of the section a separator opened go with it, the reload
+    // of its menu exports them again in their new place
+    UnityMenuModel *section = m_sectionModels.value(item);
+    if (section) {
+        QSet<UnityPlatformMenuItem*> items;
+        collectItems(section, items);
+        Q_FOREACH(UnityPlatformMenuItem *sectionItem, items) {
+            releaseItem(sectionItem);
+        }
+        scheduleItemMenu(item, CauseItemRemoved);
+    }
+
+    // Until its menu is reloaded, readers of the model must not reach the item
+    hideItem(item);
+    releaseItem(item);
+    m_itemMenus.remove(item);
+    m_dirtyItems.remove(item);
+    count(UnityExporterCounters::PropertyConnections, -itemConnectionCount);
+}
+
+// Drop everything exported for a watched menu going away.
+void UnityGMenuModelExporter::menuDestroyed(UnityPlatformMenu *gplatformMenu)
+{
+    if (!m_watchedMenus.remove(gplatformMenu)) return;
+
+    releaseMenu(gplatformMenu);
+    count(UnityExporterCounters::PropertyConnections, -menuConnectionCount);
+}
+
+// Structure changes of an exported menu, reloaded with the signal that caused it.
+void UnityGMenuModelExporter::menuItemInserted()
+{
+    auto gplatformMenu = static_cast<UnityPlatformMenu*>(sender());
+    if (menuModel(gplatformMenu)) {
+        UnityMenuUpdateScheduler::instance()->schedule(this, gplatformMenu, CauseItemInserted);
+    }
+}
+
+void UnityGMenuModelExporter::menuItemRemoved()
+{
+    auto gplatformMenu = static_cast<UnityPlatformMenu*>(sender());
+    if (menuModel(gplatformMenu)) {
+        UnityMenuUpdateScheduler::instance()->schedule(this, gplatformMenu, CauseItemRemoved);
+    }
+}
+
+void UnityGMenuModelExporter::menuEnabledChanged()
+{
+    menuEntryChanged(static_cast<UnityPlatformMenu*>(sender()));
+}
+
+void UnityGMenuModelExporter::menuPropertyChanged(int dirty)
 {
-    auto iter = gplatformMenu->menuItems().begin();
+    if (dirty & (DirtyText | DirtyIcon)) {
+        menuEntryChanged(static_cast<UnityPlatformMenu*>(sender()));
+    }
+}
+
+// Only the top level menus of a bar export properties of their own, submenus
+// are exported through the properties of their item.
+void UnityGMenuModelExporter::menuEntryChanged(UnityPlatformMenu *)
+{
+}
+
+// The enabled state of a plain item is the one of its action. The entry of an
+// item-that-is-submenu is replaced in place, with its other property changes.
+void UnityGMenuModelExporter::itemEnabledChanged(bool enabled)
+{
+    auto item = static_cast<UnityPlatformMenuItem*>(sender());
+    auto it = m_exportedItems.constFind(item);
+    if (it == m_exportedItems.constEnd()) return;
+
+    if (it->gaction) {
+        g_simple_action_set_enabled(G_SIMPLE_ACTION(it->gaction), enabled);
+    } else if (it->submenu) {
+        m_dirtyItems.insert(item);
+        m_propertyTimer.start();
+    }
+}
+
+void UnityGMenuModelExporter::itemCheckedChanged(bool checked)
+{
+    auto it = m_exportedItems.constFind(static_cast<UnityPlatformMenuItem*>(sender()));
+    if (it == m_exportedItems.constEnd() || !it->gaction) return;
+
+    auto type = g_action_get_state_type(it->gaction);
+    if (type && g_variant_type_equal(type, G_VARIANT_TYPE_BOOLEAN)) {
+        g_simple_action_set_state(G_SIMPLE_ACTION(it->gaction), g_variant_new_boolean(checked ? TRUE : FALSE));
+    }
+}
+
+// Only plain items are left out of the layout when hidden. Their entry is
+// inserted or removed in place, leaving the other entries of the menu alone.
+void UnityGMenuModelExporter::itemVisibleChanged()
+{
+    auto item = static_cast<UnityPlatformMenuItem*>(sender());
+    if (item->menu() || UnityPlatformMenuItem::get_separator(item)) return;
+
+    if (UnityPlatformMenuItem::get_visible(item)) {
+        showItem(item);
+    } else {
+        hideItem(item);
+    }
+}
+
+void UnityGMenuModelExporter::showItem(UnityPlatformMenuItem *item)
+{
+    UnityPlatformMenu *gplatformMenu = m_itemMenus.value(item);
+    if (!gplatformMenu || m_exportedItems.contains(item)) return;
+
+    UnityMenuModel *model = menuModel(gplatformMenu);
+    // Nothing exported yet, it will be built when first read
+    if (!model || m_unpopulatedModels.contains(model)) return;
+
+    // The entries the item is in: the menu's own or a section's
+    const MenuLayout layout = layoutForMenu(gplatformMenu);
+    QVector<UnityPlatformMenuItem*> entries = layout.entries;
+    for (auto it = layout.sections.constBegin(); it != layout.sections.constEnd() && !entries.contains(item); ++it) {
+        entries = it.value();
+        model = m_sectionModels.value(it.key());
+    }
+    const int position = entries.indexOf(item);
+    // Removed from the menu, which is reloaded for it
+    if (position < 0) return;
+
+    // The menu changed in other ways since, it has to be reloaded
+    QVector<UnityPlatformMenuItem*> exported = m_menuEntries.value(model);
+    if (model && m_menuEntries.contains(model)) {
+        exported.insert(position, item);
+    }
+    if (exported != entries) {
+        scheduleItemMenu(item, CauseVisibleChanged);
+        return;
+    }
+
+    exportEntry(item, model, layout, true);
+    m_menuEntries[model] = exported;
+    g_menu_model_items_changed(G_MENU_MODEL(model), position, 0, 1);
+}
+
+// Remove the entry of an exported item from its model right away.
+// The item itself isn't read, it may be going away.
+void UnityGMenuModelExporter::hideItem(UnityPlatformMenuItem *item)
+{
+    auto it = m_exportedItems.constFind(item);
+    if (it == m_exportedItems.constEnd()) return;
+
+    UnityMenuModel *model = it->parentModel;
+    const int position = m_menuEntries.value(model).indexOf(item);
+    if (position < 0) return;
+
+    m_menuEntries[model].remove(position);
+    releaseItem(item);
+    g_menu_model_items_changed(G_MENU_MODEL(model), position, 1, 0);
+}
+
+void UnityGMenuModelExporter::itemSeparatorChanged()
+{
+    scheduleItemMenu(static_cast<UnityPlatformMenuItem*>(sender()), CauseSeparatorChanged);
+}
+
+// The model a platform menu's entries are exported in.
+UnityMenuModel *UnityGMenuModelExporter::menuModel(UnityPlatformMenu *gplatformMenu) const
+{
+    return m_modelsForMenus.value(gplatformMenu);
+}
+
+void UnityGMenuModelExporter::scheduleItemMenu(UnityPlatformMenuItem *item, UnityMenuReloadCause cause)
+{
+    UnityPlatformMenu *gplatformMenu = m_itemMenus.value(item);
+    if (gplatformMenu && menuModel(gplatformMenu)) {
+        UnityMenuUpdateScheduler::instance()->schedule(this, gplatformMenu, cause);
+    }
+}
+
+// Split the items of a platform menu by its separators.
+// Items before the first separator are exported directly in the menu, the
+// following ones are grouped in a section per separator.
+UnityGMenuModelExporter::MenuLayout UnityGMenuModelExporter::layoutForMenu(UnityPlatformMenu *gplatformMenu) const
+{
+    MenuLayout layout;
+    const QVector<UnityMenuItemEntry> &items = gplatformMenu->itemTable();
+
+    auto iter = items.constBegin();
     auto lastSectionStart = iter;
+    UnityPlatformMenuItem *sectionSeparator = nullptr;
     // Iterate through all the menu items adding sections when a separator is found.
-    for (; iter != gplatformMenu->menuItems().end(); ++iter) {
-        UnityPlatformMenuItem* gplatformMenuItem = static_cast<UnityPlatformMenuItem*>(*iter);
-        if (!gplatformMenuItem) continue;
-
+    for (; iter != items.constEnd(); ++iter) {
         // don't add a section until we have separator
-        if (UnityPlatformMenuItem::get_separator(gplatformMenuItem)) {
-            if (lastSectionStart != gplatformMenu->menuItems().begin()) {
-                GMenuItem* section = createSection(lastSectionStart, iter);
-                g_menu_append_item(menu, section);
-                g_object_unref(section);
+        if (iter->flags & UnityMenuItemEntry::SeparatorFlag) {
+            if (lastSectionStart != items.constBegin()) {
+                layout.entries << sectionSeparator;
             }
+            sectionSeparator = iter->item;
+            layout.sections[sectionSeparator];
             lastSectionStart = iter + 1;
-        } else if (lastSectionStart == gplatformMenu->menuItems().begin()) {
-            processItemForGMenu(gplatformMenuItem, menu);
+        } else if (!iter->submenu && !(iter->flags & UnityMenuItemEntry::VisibleFlag)) {
+            continue;
+        } else if (lastSectionStart == items.constBegin()) {
+            layout.entries << iter->item;
+        } else {
+            layout.sections[sectionSeparator] << iter->item;
         }
     }
 
     // Add the last section
-    if (lastSectionStart != gplatformMenu->menuItems().begin() &&
-            lastSectionStart != gplatformMenu->menuItems().end()) {
-        GMenuItem* gsectionItem = createSection(lastSectionStart, gplatformMenu->menuItems().end());
-        g_menu_append_item(menu, gsectionItem);
-        g_object_unref(gsectionItem);
+    if (lastSectionStart != items.constBegin() && lastSectionStart != items.constEnd()) {
+        layout.entries << sectionSeparator;
     }
+    return layout;
 }
 
-// Create and return a gmenu item for the given platform menu item.
-// Returned GMenuItem must be cleaned up using g_object_unref
-GMenuItem *UnityGMenuModelExporter::createMenuItem(QPlatformMenuItem *platformMenuItem, GMenu *parentMenu)
+// Bring the entries of a model in line with the given ones, announcing a single
+// removal and insertion run for the part of the menu in between the unchanged
+// head and tail. Unchanged entries are only announced again when outdated.
+void UnityGMenuModelExporter::updateEntries(UnityMenuModel *model, const QVector<UnityPlatformMenuItem*> &entries, const MenuLayout &layout, bool notify)
 {
-    UnityPlatformMenuItem* gplatformMenuItem = static_cast<UnityPlatformMenuItem*>(platformMenuItem);
-    if (!gplatformMenuItem) return nullptr;
+    const QVector<UnityPlatformMenuItem*> exported = m_menuEntries.value(model);
+
+    int head = 0;
+    while (head < exported.count() && head < entries.count() &&
+           exported.at(head) == entries.at(head) && isSameEntry(entries.at(head))) {
+        ++head;
+    }
+    int tail = 0;
+    while (tail < exported.count() - head && tail < entries.count() - head &&
+           exported.at(exported.count() - tail - 1) == entries.at(entries.count() - tail - 1) &&
+           isSameEntry(entries.at(entries.count() - tail - 1))) {
+        ++tail;
+    }
+
+    // Refresh the unchanged entries, sections are updated recursively.
+    QVector<int> outdated;
+    for (int i = 0; i < exported.count(); ++i) {
+        if (i == head) i = exported.count() - tail;
+        if (i >= exported.count()) break;
+
+        UnityPlatformMenuItem *item = exported.at(i);
+        if (m_sectionModels.contains(item)) {
+            exportSection(item, layout, notify);
+        } else if (isEntryOutdated(item)) {
+            exportEntry(item, model, layout, notify);
+            outdated << (i < head ? i : i - exported.count() + entries.count());
+        }
+    }
+
+    for (int i = head; i < entries.count() - tail; ++i) {
+        exportEntry(entries.at(i), model, layout, notify);
+    }
+    m_menuEntries[model] = entries;
+
+    if (!notify) return;
+
+    const int removed = exported.count() - tail - head;
+    const int added = entries.count() - tail - head;
+    if (removed > 0 || added > 0) {
+        g_menu_model_items_changed(G_MENU_MODEL(model), head, removed, added);
+    }
+    Q_FOREACH(int position, outdated) {
+        g_menu_model_items_changed(G_MENU_MODEL(model), position, 1, 1);
+    }
+}
+
+// Whether the item is still exported as the same kind of entry it was last time.
+bool UnityGMenuModelExporter::isSameEntry(UnityPlatformMenuItem *item) const
+{
+    auto it = m_exportedItems.constFind(item);
+    if (it == m_exportedItems.constEnd()) return false;
+
+    return it->separator == UnityPlatformMenuItem::get_separator(item) &&
+           it->submenu == item->menu();
+}
+
+// Whether the attributes the item was last announced with changed since.
+bool UnityGMenuModelExporter::isEntryOutdated(UnityPlatformMenuItem *item) const
+{
+    const ExportedItem exported = m_exportedItems.value(item);
+    if (exported.dirty & (DirtyText | DirtyShortcut | DirtyIcon | DirtyCheckable)) return true;
+
+    return exported.submenu && exported.enabled != UnityPlatformMenuItem::get_enabled(item);
+}
 
-    if (!UnityPlatformMenuItem::get_visible(gplatformMenuItem))
-        return nullptr;
+// Export what an entry of the menu layout needs: the model of a section or a
+// submenu, or the action of a plain item. The entry's attributes are read from
+// the item itself when the model is.
+void UnityGMenuModelExporter::exportEntry(UnityPlatformMenuItem *item, UnityMenuModel *parentModel, const MenuLayout &layout, bool notify)
+{
+    if (m_exportedItems.contains(item) && !isSameEntry(item)) {
+        releaseItem(item);
+    }
 
-    QByteArray label(UnityPlatformMenuItem::get_text(gplatformMenuItem).toUtf8());
-    QByteArray actionLabel(getActionString(UnityPlatformMenuItem::get_text(gplatformMenuItem)).toUtf8());
-    QByteArray shortcut(UnityPlatformMenuItem::get_shortcut(gplatformMenuItem).toString(QKeySequence::NativeText).toUtf8());
+    if (!m_exportedItems.contains(item)) {
+        m_exportedItems[item].separator = UnityPlatformMenuItem::get_separator(item);
+        count(UnityExporterCounters::ItemsCreated);
+    }
+    m_exportedItems[item].parentModel = parentModel;
 
-    GMenuItem* gmenuItem = g_menu_item_new(label.constData(), nullptr);
-    g_menu_item_set_attribute(gmenuItem, "accel", "s", shortcut.constData());
-    g_menu_item_set_detailed_action(gmenuItem, ("unity." + actionLabel).constData());
+    if (UnityPlatformMenuItem::get_separator(item)) {
+        exportSection(item, layout, notify);
+    } else if (item->menu()) {
+        UnityPlatformMenu *gplatformMenu = static_cast<UnityPlatformMenu*>(item->menu());
+        exportSubmenu(gplatformMenu);
 
-    addAction(actionLabel, gplatformMenuItem, parentMenu);
-    return gmenuItem;
+        ExportedItem &exported = m_exportedItems[item];
+        exported.enabled = UnityPlatformMenuItem::get_enabled(item);
+        exported.submenu = gplatformMenu;
+    } else {
+        addAction(item);
+    }
+    m_exportedItems[item].dirty &= ~(DirtyText | DirtyShortcut | DirtyIcon);
 }
 
-// Create a menu section for a section of separated menu items.
-// Returned GMenuItem must be cleaned up using g_object_unref
-GMenuItem *UnityGMenuModelExporter::createSection(QList<QPlatformMenuItem *>::const_iterator iter, QList<QPlatformMenuItem *>::const_iterator end)
+// Export a menu section for the items following a separator.
+// The section's model is kept across reloads, only its changed entries are updated.
+void UnityGMenuModelExporter::exportSection(UnityPlatformMenuItem *separator, const MenuLayout &layout, bool notify)
 {
-    GMenu* gsectionMenu = g_menu_new();
-    for (; iter != end; ++iter) {
-        processItemForGMenu(*iter, gsectionMenu);
+    UnityMenuModel *section = m_sectionModels.value(separator);
+    if (!section) {
+        section = createModel();
+        m_sectionModels.insert(separator, section);
     }
-    GMenuItem* gsectionItem = g_menu_item_new_section("", G_MENU_MODEL(gsectionMenu));
-    g_object_unref(gsectionMenu);
-    return gsectionItem;
+    updateEntries(section, layout.sections.value(separator), layout, notify);
+}
+
+// Record the properties of an exported item that need to be patched.
+void UnityGMenuModelExporter::itemPropertyChanged(int dirty)
+{
+    auto item = static_cast<UnityPlatformMenuItem*>(sender());
+    auto it = m_exportedItems.find(item);
+    if (it == m_exportedItems.end()) return;
+
+    it->dirty |= dirty;
+    m_dirtyItems.insert(item);
+    m_propertyTimer.start();
 }
 
-// Add the given platform menu item to the menu.
-// If it has an attached submenu, then create and add the submenu.
-void UnityGMenuModelExporter::processItemForGMenu(QPlatformMenuItem *platformMenuItem, GMenu *gmenu)
+// Patch the exported entries of the items whose properties changed.
+// Label, accel and icon changes, and enabled changes of an item-that-is-submenu,
+// announce the single entry of the item in its model again, a checkable change
+// only replaces its action.
+void UnityGMenuModelExporter::patchItems()
 {
-    UnityPlatformMenuItem* gplatformMenuItem = static_cast<UnityPlatformMenuItem*>(platformMenuItem);
-    if (!gplatformMenuItem) return;
+    const QSet<UnityPlatformMenuItem*> items = m_dirtyItems;
+    m_dirtyItems.clear();
 
-    GMenuItem* gmenuItem = gplatformMenuItem->menu() ? createSubmenu(gplatformMenuItem->menu(), gplatformMenuItem) :
-                                                       createMenuItem(gplatformMenuItem, gmenu);
-    if (gmenuItem) {
-        g_menu_append_item(gmenu, gmenuItem);
-        g_object_unref(gmenuItem);
+    Q_FOREACH(UnityPlatformMenuItem *item, items) {
+        const ExportedItem exported = m_exportedItems.value(item);
+        if (!m_exportedItems.contains(item) || exported.separator) continue;
+
+        // Changing the submenu of an item is a structure change
+        if (exported.submenu != item->menu()) continue;
+
+        if ((exported.dirty & DirtyCheckable) && !exported.submenu) {
+            addAction(item);
+        }
+
+        m_exportedItems[item].dirty = 0;
+
+        const bool enabled = UnityPlatformMenuItem::get_enabled(item);
+        const bool enabledChanged = exported.submenu && exported.enabled != enabled;
+        m_exportedItems[item].enabled = enabled;
+
+        if ((exported.dirty & (DirtyText | DirtyShortcut | DirtyIcon)) || enabledChanged) {
+            const int position = m_menuEntries.value(exported.parentModel).indexOf(item);
+            if (position >= 0) {
+                g_menu_model_items_changed(G_MENU_MODEL(exported.parentModel), position, 1, 1);
+            }
+        }
     }
 }
 
-// Create and add an action for a menu item.
-void UnityGMenuModelExporter::addAction(const QByteArray &name, UnityPlatformMenuItem *gplatformMenuItem, GMenu *parentMenu)
+UnityMenuModel *UnityGMenuModelExporter::createModel()
+{
+    UnityMenuModel *model = unity_menu_model_new(this);
+    m_modelIds.insert(model, m_nextModelId++);
+    if (UnityDBusWorker::instance()) {
+        g_signal_connect(model, "items-changed", G_CALLBACK(snapshot_items_changed_cb), this);
+        // Filled without notifying when not lazy, make sure the worker gets it
+        snapshotModelChanged(G_MENU_MODEL(model));
+    }
+    return model;
+}
+
+// Detach a model from the exporter and drop its reference.
+void UnityGMenuModelExporter::releaseModel(UnityMenuModel *model)
+{
+    g_signal_handlers_disconnect_by_data(model, this);
+    const guint64 id = m_modelIds.take(model);
+    m_snapshotModels.remove(model);
+    if (m_snapshotExport) {
+        m_snapshotReleasedModels.append(id);
+        m_snapshotTimer.start();
+    }
+    unity_menu_model_detach(model);
+    g_object_unref(model);
+}
+
+// Collect the items exported in a model, including the ones in its sections.
+void UnityGMenuModelExporter::collectItems(UnityMenuModel *model, QSet<UnityPlatformMenuItem*> &items) const
+{
+    Q_FOREACH(UnityPlatformMenuItem *item, m_menuEntries.value(model)) {
+        items.insert(item);
+
+        UnityMenuModel *section = m_sectionModels.value(item);
+        if (section) {
+            collectItems(section, items);
+        }
+    }
+}
+
+// Drop everything that was exported for an item: its action, its connections,
+// its section or its submenu.
+void UnityGMenuModelExporter::releaseItem(UnityPlatformMenuItem *item)
 {
-    disconnect(gplatformMenuItem, &UnityPlatformMenuItem::checkedChanged, this, 0);
-    disconnect(gplatformMenuItem, &UnityPlatformMenuItem::enabledChanged, this, 0);
+    auto it = m_exportedItems.find(item);
+    if (it == m_exportedItems.end()) return;
 
-    QSet<QByteArray> &actions = m_actions[parentMenu];
-    QVector<QMetaObject::Connection> &propertyConnections = m_propertyConnections[parentMenu];
+    const ExportedItem exported = *it;
+    m_exportedItems.erase(it);
 
-    if (actions.contains(name)) {
-        g_action_map_remove_action(G_ACTION_MAP(m_gactionGroup), name.constData());
-        actions.remove(name);
+    count(UnityExporterCounters::ItemsDestroyed);
+
+    if (exported.gaction) {
+        g_signal_handlers_disconnect_by_data(exported.gaction, this);
+        g_action_map_remove_action(G_ACTION_MAP(m_gactionGroup), exported.action.constData());
+        count(UnityExporterCounters::ActionsDestroyed);
+    }
+    if (!exported.action.isEmpty()) {
+        m_itemsForActions.remove(exported.action);
+    }
+
+    UnityMenuModel *section = m_sectionModels.take(item);
+    if (section) {
+        m_menuEntries.remove(section);
+        releaseModel(section);
+    }
+
+    if (exported.submenu) {
+        releaseMenu(exported.submenu);
+    }
+}
+
+// Drop the model exported for a platform menu, along with all its items.
+void UnityGMenuModelExporter::releaseMenu(UnityPlatformMenu *gplatformMenu)
+{
+    UnityMenuModel *model = m_modelsForMenus.take(gplatformMenu);
+    if (!model) return;
+
+    QSet<UnityPlatformMenuItem*> items;
+    collectItems(model, items);
+    Q_FOREACH(UnityPlatformMenuItem *item, items) {
+        releaseItem(item);
+    }
+    m_menuEntries.remove(model);
+    m_unpopulatedModels.remove(model);
+
+    const quint64 tag = m_submenuTags.take(gplatformMenu);
+    if (m_submenusWithTag.value(tag) == gplatformMenu) {
+        m_submenusWithTag.remove(tag);
     }
 
+    // Hidden items stay mapped until destroyed or laid out elsewhere,
+    // their changes are dropped while the menu has no model
+    Q_FOREACH(UnityPlatformMenuItem *item, items) {
+        if (m_itemMenus.value(item) == gplatformMenu) {
+            m_itemMenus.remove(item);
+        }
+    }
+
+    UnityMenuUpdateScheduler::instance()->cancel(this, gplatformMenu);
+    m_parentMenus.remove(gplatformMenu);
+
+    releaseModel(model);
+}
+
+// Return the action name of an item, reserving it on first use.
+// Names are derived from the item tag; items sharing a tag get a numbered suffix.
+QByteArray UnityGMenuModelExporter::actionName(UnityPlatformMenuItem *gplatformMenuItem)
+{
+    ExportedItem &exported = m_exportedItems[gplatformMenuItem];
+    if (!exported.action.isEmpty()) return exported.action;
+
+    const QByteArray &base = gplatformMenuItem->exportedActionName();
+    QByteArray name = base;
+    for (int suffix = 2; m_itemsForActions.contains(name); ++suffix) {
+        name = base + '-' + QByteArray::number(suffix);
+    }
+
+    m_itemsForActions.insert(name, gplatformMenuItem);
+    exported.action = name;
+    return name;
+}
+
+// Create and add an action for a menu item.
+// The action of an item that was already exported is kept as long as its type
+// doesn't change, so the action group isn't churned by reloads.
+void UnityGMenuModelExporter::addAction(UnityPlatformMenuItem *gplatformMenuItem)
+{
+    UNITY_TRACE1(add_action_start, quint64(gplatformMenuItem->tag()));
+    const QByteArray name = actionName(gplatformMenuItem);
+    ExportedItem &exported = m_exportedItems[gplatformMenuItem];
     bool checkable = UnityPlatformMenuItem::get_checkable(gplatformMenuItem);
 
+    if (exported.gaction) {
+        if (exported.checkable == checkable) {
+            UNITY_TRACE1(add_action_end, quint64(gplatformMenuItem->tag()));
+            return;
+        }
+
+        // A stateless action can't become stateful, replace it under the same name
+        g_signal_handlers_disconnect_by_data(exported.gaction, this);
+        g_action_map_remove_action(G_ACTION_MAP(m_gactionGroup), name.constData());
+        exported.gaction = nullptr;
+        count(UnityExporterCounters::ActionsDestroyed);
+    }
+
+    // The checked and enabled changes of the item are applied by its watcher
     GSimpleAction* action = nullptr;
     if (checkable) {
         bool checked = UnityPlatformMenuItem::get_checked(gplatformMenuItem);
         action = g_simple_action_new_stateful(name.constData(), nullptr, g_variant_new_boolean(checked));
-
-        std::function<void(bool)> updateChecked = [gplatformMenuItem, action](bool checked) {
-            auto type = g_action_get_state_type(G_ACTION(action));
-            if (type && g_variant_type_equal(type, G_VARIANT_TYPE_BOOLEAN)) {
-                g_simple_action_set_state(action, g_variant_new_boolean(checked ? TRUE : FALSE));
-            }
-        };
-        // save the connection to disconnect in UnityGMenuModelExporter::clear()
-        propertyConnections << connect(gplatformMenuItem, &UnityPlatformMenuItem::checkedChanged, this, updateChecked);
     } else {
         action = g_simple_action_new(name.constData(), nullptr);
     }
+    g_simple_action_set_enabled(action, UnityPlatformMenuItem::get_enabled(gplatformMenuItem));
 
-    // Enabled update
-    std::function<void(bool)> updateEnabled = [gplatformMenuItem, action](bool enabled) {
-        GValue value = G_VALUE_INIT;
-        g_value_init (&value, G_TYPE_BOOLEAN);
-        g_value_set_boolean(&value, enabled ? TRUE : FALSE);
-        g_object_set_property(G_OBJECT(action), "enabled", &value);
-    };
-    updateEnabled(UnityPlatformMenuItem::get_enabled(gplatformMenuItem));
-    // save the connection to disconnect in UnityGMenuModelExporter::clear()
-    propertyConnections << connect(gplatformMenuItem, &UnityPlatformMenuItem::enabledChanged, this, updateEnabled);
+    g_signal_connect(action, "activate", G_CALLBACK(activate_cb), this);
 
-    g_signal_connect(action, "activate", G_CALLBACK(activate_cb), gplatformMenuItem);
-
-    actions.insert(name);
+    exported.checkable = checkable;
+    exported.dirty &= ~DirtyCheckable;
+    exported.gaction = G_ACTION(action);
     g_action_map_add_action(G_ACTION_MAP(m_gactionGroup), G_ACTION(action));
     g_object_unref(action);
+
+    count(UnityExporterCounters::ActionsCreated);
+    UNITY_TRACE1(add_action_end, quint64(gplatformMenuItem->tag()));
 }
@@ -18,15 +18,20 @@
 #define GMENUMODELEXPORTER_H
 
 #include "gmenumodelplatformmenu.h"
+#include "exportercounters.h"
+#include "unitymenumodel.h"
+#include "updatescheduler.h"
 
 #include <gio/gio.h>
 
 #include <QTimer>
-#include <QMap>
+#include <QHash>
 #include <QSet>
+#include <QVector>
 #include <QMetaObject>
 
 class QtUnityExtraActionHandler;
+class UnityMenuSnapshotExport;
 
 // Base class for a gmenumodel exporter
 class UnityGMenuModelExporter : public QObject
@@ -40,44 +45,160 @@ public:
 
     QString menuPath() const { return m_menuPath;}
 
-    void aboutToShow(quint64 tag);
+    Q_INVOKABLE void aboutToShow(quint64 tag);
+    Q_INVOKABLE void activateAction(const QByteArray &name);
+
+    void snapshotModelChanged(GMenuModel *model);
+    void snapshotActionChanged(const gchar *name);
+    // A new snapshot of the exported menus and actions, see UnityMenuSnapshotBuilder.
+    // Lazy submenus not built yet are left empty.
+    GVariant *snapshot();
+
+    const UnityExporterCounters &counters() const { return m_counters; }
+
+    virtual void reloadMenu(UnityPlatformMenu *gplatformMenu);
+    int menuDepth(UnityPlatformMenu *gplatformMenu) const;
+
+    // Read by the exported UnityMenuModels
+    virtual int itemCount(UnityMenuModel *model);
+    virtual void itemAttributes(UnityMenuModel *model, int position, GHashTable *attributes);
+    virtual void itemLinks(UnityMenuModel *model, int position, GHashTable *links);
 
 protected:
     UnityGMenuModelExporter(QObject *parent);
 
-    GMenuItem *createSubmenu(QPlatformMenu* platformMenu, UnityPlatformMenuItem* forItem);
-    GMenuItem *createMenuItem(QPlatformMenuItem* platformMenuItem, GMenu *parentMenu);
-    GMenuItem *createSection(QList<QPlatformMenuItem*>::const_iterator iter, QList<QPlatformMenuItem*>::const_iterator end);
-    void addAction(const QByteArray& name, UnityPlatformMenuItem* gplatformItem, GMenu *parentMenu);
-
-    void addSubmenuItems(UnityPlatformMenu* gplatformMenu, GMenu* menu);
-    void processItemForGMenu(QPlatformMenuItem* item, GMenu* gmenu);
+    void exportOnBus();
+    void publishSnapshot();
+    void clearSnapshotChanges();
+    guint64 modelId(GMenuModel *model) const;
+
+    UnityMenuModel *createModel();
+    void releaseModel(UnityMenuModel *model);
+
+    // The exported layout of a platform menu: the entries of its model and,
+    // for every section, the items it contains keyed by the separator opening it.
+    struct MenuLayout {
+        QVector<UnityPlatformMenuItem*> entries;
+        QHash<UnityPlatformMenuItem*, QVector<UnityPlatformMenuItem*>> sections;
+    };
+
+    // What was exported for a platform menu item, kept alive across reloads.
+    struct ExportedItem {
+        UnityMenuModel *parentModel = nullptr;
+        int dirty = 0;
+        bool enabled = true;
+        bool checkable = false;
+        bool separator = false;
+        UnityPlatformMenu *submenu = nullptr;
+        QByteArray action;
+        GAction *gaction = nullptr;
+    };
+
+    UnityMenuModel *exportSubmenu(UnityPlatformMenu *gplatformMenu);
+    void exportSection(UnityPlatformMenuItem *separator, const MenuLayout &layout, bool notify);
+    void exportEntry(UnityPlatformMenuItem *item, UnityMenuModel *parentModel, const MenuLayout &layout, bool notify);
+    void submenuAttributes(UnityPlatformMenu *gplatformMenu, const QByteArray &label, bool enabled, GHashTable *attributes) const;
+    void menuAttributes(UnityPlatformMenu *gplatformMenu, GHashTable *attributes) const;
+    QByteArray actionName(UnityPlatformMenuItem* gplatformItem);
+    void addAction(UnityPlatformMenuItem* gplatformItem);
+
+    void addSubmenuItems(UnityPlatformMenu* gplatformMenu, UnityMenuModel* model, bool notify = true);
+    void updateEntries(UnityMenuModel *model, const QVector<UnityPlatformMenuItem*> &entries, const MenuLayout &layout, bool notify);
+    MenuLayout layoutForMenu(UnityPlatformMenu *gplatformMenu) const;
+    bool isSameEntry(UnityPlatformMenuItem *item) const;
+    bool isEntryOutdated(UnityPlatformMenuItem *item) const;
+
+    void watchItem(UnityPlatformMenuItem *item);
+    void watchMenu(UnityPlatformMenu *gplatformMenu);
+    void itemDestroyed(UnityPlatformMenuItem *item);
+    void menuDestroyed(UnityPlatformMenu *gplatformMenu);
+
+    void menuItemInserted();
+    void menuItemRemoved();
+    void menuEnabledChanged();
+    void menuPropertyChanged(int dirty);
+    virtual void menuEntryChanged(UnityPlatformMenu *gplatformMenu);
+
+    void itemEnabledChanged(bool enabled);
+    void itemCheckedChanged(bool checked);
+    void itemVisibleChanged();
+    void itemSeparatorChanged();
+    void showItem(UnityPlatformMenuItem *item);
+    void hideItem(UnityPlatformMenuItem *item);
+    virtual UnityMenuModel *menuModel(UnityPlatformMenu *gplatformMenu) const;
+    void scheduleItemMenu(UnityPlatformMenuItem *item, UnityMenuReloadCause cause);
+
+    void itemPropertyChanged(int dirty);
+    virtual void patchItems();
+
+    void collectItems(UnityMenuModel *model, QSet<UnityPlatformMenuItem*> &items) const;
+    void releaseItem(UnityPlatformMenuItem *item);
+    void releaseMenu(UnityPlatformMenu *gplatformMenu);
 
     void clear();
 
-    void timerEvent(QTimerEvent *e) override;
+    // Count for the exporter and the process
+    void count(UnityExporterCounters::Counter counter, qint64 value = 1);
 
 protected:
+    // Shared session bus the models are exported on, not referenced
     GDBusConnection *m_connection;
-    GMenu *m_gmainMenu;
+    UnityMenuModel *m_mainModel;
     GSimpleActionGroup *m_gactionGroup;
     guint m_exportedModel;
     guint m_exportedActions;
     QtUnityExtraActionHandler *m_qtunityExtraHandler;
-    QTimer m_structureTimer;
+    QTimer m_propertyTimer;
     QString m_menuPath;
-
-    // UnityPlatformMenu::tag -> UnityPlatformMenu
-    QMap<quint64, UnityPlatformMenu*> m_submenusWithTag;
-
-    // UnityPlatformMenu -> reload TimerId (startTimer)
-    QHash<UnityPlatformMenu*, int> m_reloadMenuTimers;
-
-    QHash<UnityPlatformMenu*, GMenu*> m_gmenusForMenus;
-
-    QHash<GMenu*, QSet<QByteArray>> m_actions;
-    QHash<GMenu*, QVector<QMetaObject::Connection>> m_propertyConnections;
-
+    bool m_lazySubmenus;
+    bool m_exportRequested;
+    // Worker side export, when served from the dbus worker
+    UnityMenuSnapshotExport *m_snapshotExport;
+    QTimer m_snapshotTimer;
+
+    UnityExporterCounters m_counters;
+    // Nesting of addSubmenuItems calls, only the outermost one is timed
+    int m_submenuItemsDepth;
+
+    // Model -> id it is known by in snapshots, never reused
+    QHash<UnityMenuModel*, guint64> m_modelIds;
+    guint64 m_nextModelId;
+    // Changes not handed to the worker yet
+    QSet<UnityMenuModel*> m_snapshotModels;
+    QVector<guint64> m_snapshotReleasedModels;
+    QSet<QByteArray> m_snapshotActions;
+
+    // UnityPlatformMenu::tag -> UnityPlatformMenu, and the tag each one was indexed with
+    QHash<quint64, UnityPlatformMenu*> m_submenusWithTag;
+    QHash<UnityPlatformMenu*, quint64> m_submenuTags;
+
+    // Submenu -> the platform menu it was last exported in
+    QHash<UnityPlatformMenu*, UnityPlatformMenu*> m_parentMenus;
+
+    // Item -> the platform menu it was last laid out in, hidden items included
+    QHash<UnityPlatformMenuItem*, UnityPlatformMenu*> m_itemMenus;
+
+    // UnityPlatformMenu -> exported model (holds a reference)
+    QHash<UnityPlatformMenu*, UnityMenuModel*> m_modelsForMenus;
+
+    // Items and menus whose signals are connected to the exporter, until destroyed
+    QSet<UnityPlatformMenuItem*> m_watchedItems;
+    QSet<UnityPlatformMenu*> m_watchedMenus;
+
+    // Lazy submenu models still reporting no items -> their platform menu
+    QHash<UnityMenuModel*, UnityPlatformMenu*> m_unpopulatedModels;
+
+    // Separator -> section model opened by it (holds a reference)
+    QHash<UnityPlatformMenuItem*, UnityMenuModel*> m_sectionModels;
+
+    // Model -> platform menu items it currently exports, in order
+    QHash<UnityMenuModel*, QVector<UnityPlatformMenuItem*>> m_menuEntries;
+
+    QHash<UnityPlatformMenuItem*, ExportedItem> m_exportedItems;
+    // Action name -> UnityPlatformMenuItem, the item to name side is ExportedItem::action
+    QHash<QByteArray, UnityPlatformMenuItem*> m_itemsForActions;
+    // Exported items with pending property changes
+    QSet<UnityPlatformMenuItem*> m_dirtyItems;
 };
 
 // Class which exports a qt platform menu bar.
@@ -86,6 +207,22 @@ class UnityMenuBarExporter : public UnityGMenuModelExporter
 public:
     UnityMenuBarExporter(UnityPlatformMenuBar *parent);
     ~UnityMenuBarExporter();
+
+    int itemCount(UnityMenuModel *model) override;
+    void itemAttributes(UnityMenuModel *model, int position, GHashTable *attributes) override;
+    void itemLinks(UnityMenuModel *model, int position, GHashTable *links) override;
+
+private:
+    void insertMenu(QPlatformMenu *platformMenu);
+    void removeMenu(QPlatformMenu *platformMenu);
+    void menuEntryChanged(UnityPlatformMenu *gplatformMenu) override;
+    void patchItems() override;
+
+    UnityPlatformMenuBar *m_bar;
+    // Top level menus, in the order they are exported in the main menu
+    QVector<UnityPlatformMenu*> m_exportedMenus;
+    // Top level menus whose entry needs to be announced again
+    QSet<UnityPlatformMenu*> m_dirtyMenus;
 };
 
 // Class which exports a qt platform menu.
@@ -95,6 +232,16 @@ class UnityMenuExporter : public UnityGMenuModelExporter
 public:
     UnityMenuExporter(UnityPlatformMenu *parent);
     ~UnityMenuExporter();
+
+    void setMenu(UnityPlatformMenu *menu);
+
+    void reloadMenu(UnityPlatformMenu *gplatformMenu) override;
+
+protected:
+    UnityMenuModel *menuModel(UnityPlatformMenu *gplatformMenu) const override;
+
+private:
+    UnityPlatformMenu *m_menu;
 };
 
 #endif // GMENUMODELEXPORTER_H
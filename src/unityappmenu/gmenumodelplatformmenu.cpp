@@ -19,6 +19,8 @@
 #include "gmenumodelexporter.h"
 #include "registry.h"
 #include "menuregistrar.h"
+#include "menucache.h"
+#include "contextmenupool.h"
 #include "logging.h"
 
 // Qt
@@ -64,28 +66,47 @@ UnityPlatformMenuBar::UnityPlatformMenuBar()
 
     connect(this, &UnityPlatformMenuBar::menuInserted, this, &UnityPlatformMenuBar::structureChanged);
     connect(this,&UnityPlatformMenuBar::menuRemoved, this, &UnityPlatformMenuBar::structureChanged);
+
+    // The saved menus are replaced once the menus inserted together are exported
+    m_cacheTimer.setSingleShot(true);
+    m_cacheTimer.setInterval(0);
+    connect(&m_cacheTimer, &QTimer::timeout, this, &UnityPlatformMenuBar::dropCachedMenus);
+    connect(this, &UnityPlatformMenuBar::structureChanged, this, [this]() {
+        if (m_cache) {
+            m_cacheTimer.start();
+        }
+    });
+
+    // Save the menus for the next run while the application still has all of them
+    connect(QCoreApplication::instance(), &QCoreApplication::aboutToQuit, this, &UnityPlatformMenuBar::saveMenus);
 }
 
 UnityPlatformMenuBar::~UnityPlatformMenuBar()
 {
     BAR_DEBUG_MSG << "()";
+
+    Q_FOREACH(QPlatformMenu *platformMenu, m_menus) {
+        auto menu = static_cast<UnityPlatformMenu*>(platformMenu);
+        if (menu && menu->m_parentBar == this) {
+            menu->m_parentBar = nullptr;
+        }
+    }
 }
 
 void UnityPlatformMenuBar::insertMenu(QPlatformMenu *menu, QPlatformMenu *before)
 {
     BAR_DEBUG_MSG << "(menu=" << menu << ", before=" <<  before << ")";
 
-    if (m_menus.contains(menu)) return;
+    if (m_menuIndex.contains(menu)) return;
 
-    if (!before) {
+    // Appended when the menu to insert before isn't in the bar
+    const int position = before ? m_menus.indexOf(before) : -1;
+    m_menuIndex.insert(menu);
+    static_cast<UnityPlatformMenu*>(menu)->m_parentBar = this;
+    if (position < 0) {
         m_menus.push_back(menu);
     } else {
-        for (auto iter = m_menus.begin(); iter != m_menus.end(); ++iter) {
-            if (*iter == before) {
-                m_menus.insert(iter, menu);
-                break;
-            }
-        }
+        m_menus.insert(position, menu);
     }
     Q_EMIT menuInserted(menu);
 }
@@ -94,12 +115,13 @@ void UnityPlatformMenuBar::removeMenu(QPlatformMenu *menu)
 {
     BAR_DEBUG_MSG << "(menu=" << menu << ")";
 
-    QMutableListIterator<QPlatformMenu*> iterator(m_menus);
-    while(iterator.hasNext()) {
-        if (iterator.next() == menu) {
-            iterator.remove();
-            break;
-        }
+    if (!m_menuIndex.contains(menu)) return;
+
+    m_menuIndex.remove(menu);
+    m_menus.removeOne(menu);
+    auto unityMenu = static_cast<UnityPlatformMenu*>(menu);
+    if (unityMenu->m_parentBar == this) {
+        unityMenu->m_parentBar = nullptr;
     }
     Q_EMIT menuRemoved(menu);
 }
@@ -116,17 +138,29 @@ void UnityPlatformMenuBar::handleReparent(QWindow *parentWindow)
     BAR_DEBUG_MSG << "(parentWindow=" << parentWindow << ")";
 
     setReady(true);
-    m_registrar->registerMenuForWindow(parentWindow, QDBusObjectPath(m_exporter->menuPath()));
+    m_window = parentWindow;
+
+    // Show the menus saved on the last run until the application populated its own
+    m_cache.reset();
+    if (m_menus.isEmpty() && parentWindow && UnityMenuCache::isEnabled()) {
+        m_cache.reset(new UnityMenuCache(m_exporter.data(), parentWindow));
+        if (!m_cache->isValid()) {
+            m_cache.reset();
+        }
+    }
+
+    const QString menuPath = m_cache ? m_cache->menuPath() : m_exporter->menuPath();
+    m_registrar->registerMenuForWindow(parentWindow, QDBusObjectPath(menuPath));
+}
+
+QString UnityPlatformMenuBar::exportedPath() const
+{
+    return m_exporter->menuPath();
 }
 
 QPlatformMenu *UnityPlatformMenuBar::menuForTag(quintptr tag) const
 {
-    Q_FOREACH(QPlatformMenu* menu, m_menus) {
-        if (menu->tag() == tag) {
-            return menu;
-        }
-    }
-    return nullptr;
+    return m_menuIndex.value(tag);
 }
 
 const QList<QPlatformMenu *> UnityPlatformMenuBar::menus() const
@@ -165,13 +199,36 @@ void UnityPlatformMenuBar::setReady(bool isReady)
     }
 }
 
+void UnityPlatformMenuBar::saveMenus()
+{
+    if (!m_window || m_menus.isEmpty() || !UnityMenuCache::isEnabled()) return;
+
+    // Lazy submenus nobody opened are saved empty rather than built now
+    GVariant *snapshot = m_exporter->snapshot();
+    UnityMenuCache::save(m_window, snapshot);
+    g_variant_unref(snapshot);
+}
+
+// Register the exported menus in place of the saved ones.
+void UnityPlatformMenuBar::dropCachedMenus()
+{
+    if (!m_cache) return;
+
+    m_registrar->registerMenuForWindow(m_window, QDBusObjectPath(m_exporter->menuPath()));
+    m_cache.reset();
+}
+
 //////////////////////////////////////////////////////////////
 
 UnityPlatformMenu::UnityPlatformMenu()
-    : m_tag(reinterpret_cast<quintptr>(this))
+    : m_visible(true)
+    , m_enabled(true)
+    , m_tag(reinterpret_cast<quintptr>(this))
+    , m_parentBar(nullptr)
     , m_parentWindow(nullptr)
     , m_exporter(nullptr)
     , m_registrar(nullptr)
+    , m_itemTableValid(false)
 {
     MENU_DEBUG_MSG << "()";
 
@@ -182,24 +239,39 @@ UnityPlatformMenu::UnityPlatformMenu()
 UnityPlatformMenu::~UnityPlatformMenu()
 {
     MENU_DEBUG_MSG << "()";
+
+    Q_FOREACH(QPlatformMenuItem *menuItem, m_menuItems) {
+        auto item = static_cast<UnityPlatformMenuItem*>(menuItem);
+        if (item && item->m_parentMenu == this) {
+            item->m_parentMenu = nullptr;
+        }
+    }
+
+    // Keep the context menu export warm for the next menu shown
+    if (m_exporter) {
+        UnityContextMenuPool::Export warm;
+        warm.exporter = static_cast<UnityMenuExporter*>(m_exporter.take());
+        warm.registrar = m_registrar.take();
+        UnityContextMenuPool::instance()->recycle(warm);
+    }
 }
 
 void UnityPlatformMenu::insertMenuItem(QPlatformMenuItem *menuItem, QPlatformMenuItem *before)
 {
     MENU_DEBUG_MSG << "(menuItem=" << menuItem << ", before=" << before << ")";
 
-    if (m_menuItems.contains(menuItem)) return;
+    if (m_itemIndex.contains(menuItem)) return;
 
-    if (!before) {
+    // Appended when the item to insert before isn't in the menu
+    const int position = before ? m_menuItems.indexOf(before) : -1;
+    m_itemIndex.insert(menuItem);
+    static_cast<UnityPlatformMenuItem*>(menuItem)->m_parentMenu = this;
+    if (position < 0) {
         m_menuItems.push_back(menuItem);
     } else {
-        for (auto iter = m_menuItems.begin(); iter != m_menuItems.end(); ++iter) {
-            if (*iter == before) {
-                m_menuItems.insert(iter, menuItem);
-                break;
-            }
-        }
+        m_menuItems.insert(position, menuItem);
     }
+    invalidateItemTable();
 
     Q_EMIT menuItemInserted(menuItem);
 }
@@ -208,13 +280,16 @@ void UnityPlatformMenu::removeMenuItem(QPlatformMenuItem *menuItem)
 {
     MENU_DEBUG_MSG << "(menuItem=" << menuItem << ")";
 
-    QMutableListIterator<QPlatformMenuItem*> iterator(m_menuItems);
-    while(iterator.hasNext()) {
-        if (iterator.next() == menuItem) {
-            iterator.remove();
-            break;
-        }
+    if (!m_itemIndex.contains(menuItem)) return;
+
+    m_itemIndex.remove(menuItem);
+    m_menuItems.removeOne(menuItem);
+    auto item = static_cast<UnityPlatformMenuItem*>(menuItem);
+    if (item->m_parentMenu == this) {
+        item->m_parentMenu = nullptr;
     }
+    invalidateItemTable();
+
     Q_EMIT menuItemRemoved(menuItem);
 }
 
@@ -234,6 +309,9 @@ void UnityPlatformMenu::syncSeparatorsCollapsible(bool enable)
 void UnityPlatformMenu::setTag(quintptr tag)
 {
     MENU_DEBUG_MSG << "(tag=" << tag << ")";
+    if (m_parentBar) {
+        m_parentBar->m_menuIndex.retag(this, m_tag, tag);
+    }
     m_tag = tag;
 }
 
@@ -247,6 +325,7 @@ void UnityPlatformMenu::setText(const QString &text)
     MENU_DEBUG_MSG << "(text=" << text << ")";
     if (m_text != text) {
         m_text = text;
+        Q_EMIT propertyChanged(DirtyText);
     }
 }
 
@@ -256,6 +335,7 @@ void UnityPlatformMenu::setIcon(const QIcon &icon)
 
     if (!icon.isNull() || (!m_icon.isNull() && icon.isNull())) {
         m_icon = icon;
+        Q_EMIT propertyChanged(DirtyIcon);
     }
 }
 
@@ -297,9 +377,16 @@ void UnityPlatformMenu::showPopup(const QWindow *parentWindow, const QRect &targ
     MENU_DEBUG_MSG << "(parentWindow=" << parentWindow << ", targetRect=" << targetRect << ", item=" << item << ")";
 
     if (!m_exporter) {
-        m_exporter.reset(new UnityMenuExporter(this));
-        m_exporter->exportModels();
+        UnityContextMenuPool::Export warm = UnityContextMenuPool::instance()->take(this);
+        if (warm.exporter) {
+            m_exporter.reset(warm.exporter);
+            m_registrar.reset(warm.registrar);
+        } else {
+            m_exporter.reset(new UnityMenuExporter(this));
+        }
     }
+    // Nothing to do if still exported since the last popup
+    m_exporter->exportModels();
 
     if (parentWindow != m_parentWindow) {
         if (m_parentWindow) {
@@ -320,12 +407,16 @@ void UnityPlatformMenu::showPopup(const QWindow *parentWindow, const QRect &targ
     setVisible(true);
 }
 
+// The registration goes away with the popup. The export is kept warm for the
+// next popup, it goes to the context menu pool along with the menu.
 void UnityPlatformMenu::dismiss()
 {
     MENU_DEBUG_MSG << "()";
 
-    if (m_registrar) { m_registrar->unregisterMenu(); }
-    if (m_exporter) { m_exporter->unexportModels(); }
+    if (m_registrar) {
+        m_registrar->unregisterMenu();
+    }
+    m_parentWindow = nullptr;
 }
 
 QPlatformMenuItem *UnityPlatformMenu::menuItemAt(int position) const
@@ -336,12 +427,7 @@ QPlatformMenuItem *UnityPlatformMenu::menuItemAt(int position) const
 
 QPlatformMenuItem *UnityPlatformMenu::menuItemForTag(quintptr tag) const
 {
-    Q_FOREACH(QPlatformMenuItem* menuItem, m_menuItems) {
-        if (menuItem->tag() == tag) {
-            return menuItem;
-        }
-    }
-    return nullptr;
+    return m_itemIndex.value(tag, m_menuItems);
 }
 
 QPlatformMenuItem *UnityPlatformMenu::createMenuItem() const
@@ -361,6 +447,50 @@ const QList<QPlatformMenuItem *> UnityPlatformMenu::menuItems() const
     return m_menuItems;
 }
 
+const QVector<UnityMenuItemEntry> &UnityPlatformMenu::itemTable() const
+{
+    if (!m_itemTableValid) {
+        m_itemTable.clear();
+        m_itemTable.reserve(m_menuItems.count());
+        Q_FOREACH(QPlatformMenuItem *menuItem, m_menuItems) {
+            auto item = static_cast<UnityPlatformMenuItem*>(menuItem);
+            if (!item) continue;
+
+            UnityMenuItemEntry entry;
+            entry.item = item;
+            entry.submenu = static_cast<UnityPlatformMenu*>(item->m_menu);
+            entry.flags = (item->m_separator ? UnityMenuItemEntry::SeparatorFlag : 0) |
+                          (item->m_visible ? UnityMenuItemEntry::VisibleFlag : 0);
+            m_itemTable << entry;
+        }
+        m_itemTableValid = true;
+    }
+    return m_itemTable;
+}
+
+// Menus repeat the same few accels and labels, equal ones are exported as a
+// single shared copy. The copies the items of the menu stopped using are
+// dropped once the pool outgrows a label and an accel per item.
+QByteArray UnityPlatformMenu::intern(const QByteArray &string) const
+{
+    auto iter = m_strings.constFind(string);
+    if (iter != m_strings.constEnd()) {
+        return *iter;
+    }
+
+    if (m_strings.count() >= 2 * m_menuItems.count()) {
+        for (auto unused = m_strings.begin(); unused != m_strings.end();) {
+            if (unused->isDetached()) {
+                unused = m_strings.erase(unused);
+            } else {
+                ++unused;
+            }
+        }
+    }
+    m_strings.insert(string);
+    return string;
+}
+
 QDebug UnityPlatformMenu::operator<<(QDebug stream)
 {
     stream.nospace().noquote() << QString("%1").arg("", logRecusion, QLatin1Char('\t'))
@@ -379,8 +509,14 @@ QDebug UnityPlatformMenu::operator<<(QDebug stream)
 //////////////////////////////////////////////////////////////
 
 UnityPlatformMenuItem::UnityPlatformMenuItem()
-    : m_menu(nullptr)
+    : m_separator(false)
+    , m_visible(true)
+    , m_enabled(true)
+    , m_checkable(false)
+    , m_checked(false)
+    , m_menu(nullptr)
     , m_tag(reinterpret_cast<quintptr>(this))
+    , m_parentMenu(nullptr)
 {
     ITEM_DEBUG_MSG << "()";
 }
@@ -388,12 +524,24 @@ UnityPlatformMenuItem::UnityPlatformMenuItem()
 UnityPlatformMenuItem::~UnityPlatformMenuItem()
 {
     ITEM_DEBUG_MSG << "()";
+    invalidateParentTable();
+}
+
+void UnityPlatformMenuItem::invalidateParentTable()
+{
+    if (m_parentMenu) {
+        m_parentMenu->invalidateItemTable();
+    }
 }
 
 void UnityPlatformMenuItem::setTag(quintptr tag)
 {
     ITEM_DEBUG_MSG << "(tag=" << tag << ")";
+    if (m_parentMenu) {
+        m_parentMenu->m_itemIndex.retag(this, m_tag, tag);
+    }
     m_tag = tag;
+    m_exportRecord.valid &= ~UnityMenuItemExportRecord::ActionNameField;
 }
 
 quintptr UnityPlatformMenuItem::tag() const
@@ -406,6 +554,8 @@ void UnityPlatformMenuItem::setText(const QString &text)
     ITEM_DEBUG_MSG << "(text=" << text << ")";
     if (m_text != text) {
         m_text = text;
+        m_exportRecord.valid &= ~UnityMenuItemExportRecord::LabelField;
+        Q_EMIT propertyChanged(DirtyText);
     }
 }
 
@@ -415,6 +565,7 @@ void UnityPlatformMenuItem::setIcon(const QIcon &icon)
 
     if (!icon.isNull() || (!m_icon.isNull() && icon.isNull())) {
         m_icon = icon;
+        Q_EMIT propertyChanged(DirtyIcon);
     }
 }
 
@@ -423,6 +574,7 @@ void UnityPlatformMenuItem::setVisible(bool isVisible)
     ITEM_DEBUG_MSG << "(visible=" << isVisible << ")";
     if (m_visible != isVisible) {
         m_visible = isVisible;
+        invalidateParentTable();
         Q_EMIT visibleChanged(m_visible);
     }
 }
@@ -432,6 +584,8 @@ void UnityPlatformMenuItem::setIsSeparator(bool isSeparator)
     ITEM_DEBUG_MSG << "(separator=" << isSeparator << ")";
     if (m_separator != isSeparator) {
         m_separator = isSeparator;
+        invalidateParentTable();
+        Q_EMIT separatorChanged(m_separator);
     }
 }
 
@@ -452,6 +606,7 @@ void UnityPlatformMenuItem::setCheckable(bool checkable)
     ITEM_DEBUG_MSG << "(checkable=" << checkable << ")";
     if (m_checkable != checkable) {
         m_checkable = checkable;
+        Q_EMIT propertyChanged(DirtyCheckable);
     }
 }
 
@@ -469,6 +624,8 @@ void UnityPlatformMenuItem::setShortcut(const QKeySequence &shortcut)
     ITEM_DEBUG_MSG << "(shortcut=" << shortcut << ")";
     if (m_shortcut != shortcut) {
         m_shortcut = shortcut;
+        m_exportRecord.valid &= ~UnityMenuItemExportRecord::AccelField;
+        Q_EMIT propertyChanged(DirtyShortcut);
     }
 }
 
@@ -484,7 +641,13 @@ void UnityPlatformMenuItem::setEnabled(bool enabled)
 void UnityPlatformMenuItem::setIconSize(int size)
 {
     ITEM_DEBUG_MSG << "(size=" << size << ")";
-    Q_UNUSED(size);
+    if (m_iconSize != size) {
+        m_iconSize = size;
+        // Only a rasterized icon depends on the size
+        if (!m_icon.isNull() && m_icon.name().isEmpty()) {
+            Q_EMIT propertyChanged(DirtyIcon);
+        }
+    }
 }
 
 void UnityPlatformMenuItem::setMenu(QPlatformMenu *menu)
@@ -492,6 +655,7 @@ void UnityPlatformMenuItem::setMenu(QPlatformMenu *menu)
     ITEM_DEBUG_MSG << "(menu=" << menu << ")";
     if (m_menu != menu) {
         m_menu = menu;
+        invalidateParentTable();
 
         if (menu) {
             connect(menu, &QObject::destroyed,
@@ -505,6 +669,37 @@ QPlatformMenu *UnityPlatformMenuItem::menu() const
     return m_menu;
 }
 
+// The base action name is derived from the tag, which identifies the item
+// for its whole lifetime whatever its label.
+const QByteArray &UnityPlatformMenuItem::exportedActionName() const
+{
+    if (!(m_exportRecord.valid & UnityMenuItemExportRecord::ActionNameField)) {
+        m_exportRecord.actionName = QByteArrayLiteral("item-") + QByteArray::number(quint64(m_tag), 16);
+        m_exportRecord.valid |= UnityMenuItemExportRecord::ActionNameField;
+    }
+    return m_exportRecord.actionName;
+}
+
+const QByteArray &UnityPlatformMenuItem::exportedLabel() const
+{
+    if (!(m_exportRecord.valid & UnityMenuItemExportRecord::LabelField)) {
+        const QByteArray label = m_text.toUtf8();
+        m_exportRecord.label = m_parentMenu ? m_parentMenu->intern(label) : label;
+        m_exportRecord.valid |= UnityMenuItemExportRecord::LabelField;
+    }
+    return m_exportRecord.label;
+}
+
+const QByteArray &UnityPlatformMenuItem::exportedAccel() const
+{
+    if (!(m_exportRecord.valid & UnityMenuItemExportRecord::AccelField)) {
+        const QByteArray accel = m_shortcut.toString(QKeySequence::NativeText).toUtf8();
+        m_exportRecord.accel = m_parentMenu ? m_parentMenu->intern(accel) : accel;
+        m_exportRecord.valid |= UnityMenuItemExportRecord::AccelField;
+    }
+    return m_exportRecord.accel;
+}
+
 QDebug UnityPlatformMenuItem::operator<<(QDebug stream)
 {
     QString properties = "text=\"" + m_text + "\"";
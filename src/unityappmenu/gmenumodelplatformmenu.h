@@ -19,11 +19,43 @@
 
 #include <qpa/qplatformmenu.h>
 
+#include <QMultiHash>
+#include <QPointer>
+#include <QSet>
+#include <QTimer>
+#include <QVector>
+
 // Local
 class UnityGMenuModelExporter;
+class UnityMenuCache;
 class UnityMenuRegistrar;
+class UnityPlatformMenu;
+class UnityPlatformMenuItem;
 class QWindow;
 
+// Tag -> object index of the menus of a bar or of the items of a menu, so that
+// Qt's lookups by tag don't scan them. It is changed before the list it indexes.
+// Should Qt retag an object once indexed, its container moves it to the new tag.
+template<typename T>
+class UnityTagIndex
+{
+public:
+    void insert(T *object) { m_objects.insert(object->tag(), object); }
+    void remove(T *object) { m_objects.remove(object->tag(), object); }
+    bool contains(T *object) const { return m_objects.contains(object->tag(), object); }
+    T *value(quintptr tag) const { return m_objects.value(tag); }
+
+    void retag(T *object, quintptr oldTag, quintptr newTag)
+    {
+        if (m_objects.remove(oldTag, object)) {
+            m_objects.insert(newTag, object);
+        }
+    }
+
+private:
+    QMultiHash<quintptr, T*> m_objects;
+};
+
 class UnityPlatformMenuBar : public QPlatformMenuBar
 {
     Q_OBJECT
@@ -56,17 +88,69 @@ Q_SIGNALS:
 
 private:
     void setReady(bool);
+    void saveMenus();
+    void dropCachedMenus();
 
     QList<QPlatformMenu*> m_menus;
+    UnityTagIndex<QPlatformMenu> m_menuIndex;
     QScopedPointer<UnityGMenuModelExporter> m_exporter;
     QScopedPointer<UnityMenuRegistrar> m_registrar;
     bool m_ready;
+    QPointer<QWindow> m_window;
+    // The menus saved on the last run, registered until the bar is populated
+    QScopedPointer<UnityMenuCache> m_cache;
+    QTimer m_cacheTimer;
+
+    friend class UnityPlatformMenu;
+};
+
+// Properties whose change has to be patched into the exported menu
+enum UnityMenuDirtyFlag {
+    DirtyText = 0x1,
+    DirtyShortcut = 0x2,
+    DirtyIcon = 0x4,
+    DirtyCheckable = 0x8
+};
+
+// Exported representation of a menu item, computed on first use and
+// invalidated by the setters of the properties it derives from.
+struct UnityMenuItemExportRecord
+{
+    enum Field {
+        ActionNameField = 0x1,
+        LabelField = 0x2,
+        AccelField = 0x4
+    };
+
+    QByteArray actionName;
+    QByteArray label;
+    QByteArray accel;
+    quint8 valid = 0;
+};
+
+// What laying out a menu reads from one of its items, kept contiguous per menu
+// so the exporter doesn't chase every item to split the menu in sections.
+struct UnityMenuItemEntry
+{
+    enum Flag {
+        SeparatorFlag = 0x1,
+        VisibleFlag = 0x2
+    };
+
+    UnityPlatformMenuItem *item;
+    UnityPlatformMenu *submenu;
+    quint8 flags;
 };
 
 #define MENU_PROPERTY(class, name, type, defaultValue) \
     static type get_##name(const class *menuItem) { return menuItem->m_##name; } \
     type m_##name = defaultValue;
 
+// A boolean property packed with the others of its class, initialized by the constructor
+#define MENU_FLAG(class, name) \
+    static bool get_##name(const class *menuItem) { return menuItem->m_##name; } \
+    bool m_##name : 1;
+
 class Q_DECL_EXPORT UnityPlatformMenu : public QPlatformMenu
 {
     Q_OBJECT
@@ -104,6 +188,7 @@ public:
     int id() const;
 
     const QList<QPlatformMenuItem*> menuItems() const;
+    const QVector<UnityMenuItemEntry> &itemTable() const;
 
     QDebug operator<<(QDebug stream);
 
@@ -112,20 +197,34 @@ Q_SIGNALS:
     void menuItemRemoved(QPlatformMenuItem *menuItem);
     void structureChanged();
     void enabledChanged(bool);
+    void propertyChanged(int dirty);
 
 private:
-    MENU_PROPERTY(UnityPlatformMenu, visible, bool, true)
+    MENU_FLAG(UnityPlatformMenu, visible)
+    MENU_FLAG(UnityPlatformMenu, enabled)
     MENU_PROPERTY(UnityPlatformMenu, text, QString, QString())
-    MENU_PROPERTY(UnityPlatformMenu, enabled, bool, true)
     MENU_PROPERTY(UnityPlatformMenu, icon, QIcon, QIcon())
 
+    QByteArray intern(const QByteArray &string) const;
+    void invalidateItemTable() { m_itemTableValid = false; }
+
     quintptr m_tag;
     QList<QPlatformMenuItem*> m_menuItems;
+    UnityTagIndex<QPlatformMenuItem> m_itemIndex;
+    UnityPlatformMenuBar *m_parentBar;
     const QWindow* m_parentWindow;
     QScopedPointer<UnityGMenuModelExporter> m_exporter;
     QScopedPointer<UnityMenuRegistrar> m_registrar;
 
+    // Rebuilt on use after the items or what the table keeps of them changed
+    mutable QVector<UnityMenuItemEntry> m_itemTable;
+    mutable bool m_itemTableValid;
+    // Labels and accels exported for the items, shared by the equal ones
+    mutable QSet<QByteArray> m_strings;
+
     friend class UnityGMenuModelExporter;
+    friend class UnityPlatformMenuBar;
+    friend class UnityPlatformMenuItem;
 };
 
 
@@ -154,28 +253,39 @@ public:
 
     QPlatformMenu* menu() const;
 
+    const QByteArray &exportedActionName() const;
+    const QByteArray &exportedLabel() const;
+    const QByteArray &exportedAccel() const;
+
     QDebug operator<<(QDebug stream);
 
 Q_SIGNALS:
     void checkedChanged(bool);
     void enabledChanged(bool);
     void visibleChanged(bool);
+    void separatorChanged(bool);
+    void propertyChanged(int dirty);
 
 private:
-    MENU_PROPERTY(UnityPlatformMenuItem, separator, bool, false)
-    MENU_PROPERTY(UnityPlatformMenuItem, visible, bool, true)
+    // What the exporter reads to lay out a menu comes first, in one word
+    MENU_FLAG(UnityPlatformMenuItem, separator)
+    MENU_FLAG(UnityPlatformMenuItem, visible)
+    MENU_FLAG(UnityPlatformMenuItem, enabled)
+    MENU_FLAG(UnityPlatformMenuItem, checkable)
+    MENU_FLAG(UnityPlatformMenuItem, checked)
+    MENU_PROPERTY(UnityPlatformMenuItem, menu, QPlatformMenu*, nullptr)
     MENU_PROPERTY(UnityPlatformMenuItem, text, QString, QString())
-    MENU_PROPERTY(UnityPlatformMenuItem, enabled, bool, true)
-    MENU_PROPERTY(UnityPlatformMenuItem, checkable, bool, false)
-    MENU_PROPERTY(UnityPlatformMenuItem, checked, bool, false)
     MENU_PROPERTY(UnityPlatformMenuItem, shortcut, QKeySequence, QKeySequence())
     MENU_PROPERTY(UnityPlatformMenuItem, icon, QIcon, QIcon())
     MENU_PROPERTY(UnityPlatformMenuItem, iconSize, int, 16)
-    MENU_PROPERTY(UnityPlatformMenuItem, menu, QPlatformMenu*, nullptr)
 
+    void invalidateParentTable();
 
     quintptr m_tag;
+    UnityPlatformMenu *m_parentMenu;
+    mutable UnityMenuItemExportRecord m_exportRecord;
     friend class UnityGMenuModelExporter;
+    friend class UnityPlatformMenu;
 };
 
 #endif // EXPORTEDPLATFORMMENUBAR_H
@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2016 Canonical, Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "iconcache.h"
+#include "exportercounters.h"
+#include "logging.h"
+
+#include <QBuffer>
+#include <QPixmap>
+
+namespace {
+
+// Enough for a few hundred distinct menu icons
+const int maxCacheCost = 4 * 1024 * 1024;
+
+} // namespace
+
+UnityIconCache *UnityIconCache::instance()
+{
+    static UnityIconCache* cache(new UnityIconCache());
+    return cache;
+}
+
+UnityIconCache::UnityIconCache()
+    : m_icons(maxCacheCost)
+{
+}
+
+GVariant *UnityIconCache::serializedIcon(const QIcon &icon, int size)
+{
+    if (icon.isNull()) return nullptr;
+
+    // A themed icon doesn't depend on the size, the shell picks it
+    const Key key(icon.cacheKey(), icon.name().isEmpty() ? size : 0);
+    Entry *entry = m_icons.object(key);
+    if (!entry) {
+        GVariant *serialized = serialize(icon, key.second);
+        if (!serialized) return nullptr;
+
+        // The cache drops an icon bigger than the whole of it right away
+        m_icons.insert(key, new Entry(g_variant_ref(serialized)), int(g_variant_get_size(serialized)));
+        return serialized;
+    }
+    return g_variant_ref(entry->serialized);
+}
+
+GVariant *UnityIconCache::serialize(const QIcon &icon, int size) const
+{
+    GIcon *gicon = nullptr;
+    if (!icon.name().isEmpty()) {
+        gicon = g_themed_icon_new(icon.name().toUtf8().constData());
+    } else {
+        const QPixmap pixmap = icon.pixmap(size);
+        if (pixmap.isNull()) return nullptr;
+
+        QByteArray png;
+        QBuffer buffer(&png);
+        buffer.open(QIODevice::WriteOnly);
+        if (!pixmap.save(&buffer, "PNG")) {
+            qCWarning(unityappmenu, "Failed to encode a menu icon");
+            return nullptr;
+        }
+        UnityExporterCounters::process()->add(UnityExporterCounters::IconsEncoded);
+
+        GBytes *bytes = g_bytes_new(png.constData(), png.size());
+        gicon = g_bytes_icon_new(bytes);
+        g_bytes_unref(bytes);
+    }
+
+    GVariant *serialized = g_icon_serialize(gicon);
+    g_object_unref(gicon);
+    return serialized;
+}
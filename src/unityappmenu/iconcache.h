@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2016 Canonical, Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UNITY_ICON_CACHE_H
+#define UNITY_ICON_CACHE_H
+
+#include <QCache>
+#include <QIcon>
+#include <QPair>
+
+#include <gio/gio.h>
+
+// Serialized GIcons of the exported menu items, shared by all the exporters
+// of the process. Themed icons are exported by name, the others as PNG bytes
+// encoded once per icon (QIcon::cacheKey) and size. GUI thread only.
+class UnityIconCache
+{
+public:
+    static UnityIconCache *instance();
+
+    // The icon as a G_MENU_ATTRIBUTE_ICON value (new reference), null for none
+    GVariant *serializedIcon(const QIcon &icon, int size);
+
+private:
+    struct Entry {
+        explicit Entry(GVariant *variant) : serialized(variant) {}
+        ~Entry() { g_variant_unref(serialized); }
+        GVariant *serialized;
+    };
+    typedef QPair<qint64, int> Key;
+
+    UnityIconCache();
+    Q_DISABLE_COPY(UnityIconCache)
+
+    GVariant *serialize(const QIcon &icon, int size) const;
+
+    // Costed by the serialized size, in bytes
+    QCache<Key, Entry> m_icons;
+};
+
+#endif // UNITY_ICON_CACHE_H
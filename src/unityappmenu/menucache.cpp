@@ -0,0 +1,172 @@
+/*
+ * Copyright (C) 2016 Canonical, Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "menucache.h"
+#include "dbusworker.h"
+#include "gmenumodelexporter.h"
+#include "logging.h"
+#include "menusnapshot.h"
+#include "sessionbus.h"
+
+#include <QCoreApplication>
+#include <QFile>
+#include <QVariant>
+#include <QWindow>
+
+#include <glib/gstdio.h>
+
+namespace {
+
+// Keep the free form names in the file name to a portable set of characters
+QString fileNamePart(const QString &name)
+{
+    QString part;
+    Q_FOREACH(QChar c, name) {
+        part += (c.isLetterOrNumber() || c == QLatin1Char('-') || c == QLatin1Char('.')) ? c : QLatin1Char('_');
+    }
+    return part;
+}
+
+} // namespace
+
+UnityMenuCache::UnityMenuCache(UnityGMenuModelExporter *exporter, QWindow *window)
+    : m_exporter(exporter)
+    , m_menuPath(exporter->menuPath() + QStringLiteral("/Cached"))
+    , m_snapshot(nullptr)
+    , m_export(nullptr)
+{
+    const QByteArray fileName = cacheFile(window);
+    GError *error = nullptr;
+    GMappedFile *file = g_mapped_file_new(fileName.constData(), FALSE, &error);
+    if (!file) {
+        qCDebug(unityappmenu, "No saved menus - %s", error ? error->message : "unknown error");
+        g_error_free(error);
+        return;
+    }
+
+    GBytes *bytes = g_mapped_file_get_bytes(file);
+    g_mapped_file_unref(file);
+    if (g_bytes_get_size(bytes) == 0) {
+        g_bytes_unref(bytes);
+        return;
+    }
+    GVariant *contents = g_variant_ref_sink(g_variant_new_from_bytes(G_VARIANT_TYPE("(uv)"), bytes, FALSE));
+    g_bytes_unref(bytes);
+
+    guint32 version;
+    GVariant *saved;
+    g_variant_get(contents, "(uv)", &version, &saved);
+    g_variant_unref(contents);
+    // Written by another version, or not by us at all
+    if (version != FileVersion || !g_variant_is_of_type(saved, G_VARIANT_TYPE(UNITY_MENU_SNAPSHOT_TYPE))) {
+        qCWarning(unityappmenu, "Discarding saved menus of version %u and type %s", version,
+                  g_variant_get_type_string(saved));
+        g_variant_unref(saved);
+        g_unlink(fileName.constData());
+        return;
+    }
+    m_snapshot = unityMenuSnapshotInert(saved);
+    g_variant_unref(saved);
+
+    UnitySessionBus *bus = UnitySessionBus::instance();
+    bus->acquire();
+    if (bus->connection()) {
+        exportOnBus(bus->connection());
+    } else {
+        connect(bus, &UnitySessionBus::ready, this, &UnityMenuCache::exportOnBus);
+    }
+}
+
+UnityMenuCache::~UnityMenuCache()
+{
+    if (m_export) {
+        // Make sure the worker is done with the export before it goes away
+        UnityMenuSnapshotExport *cachedExport = m_export;
+        if (UnityDBusWorker::instance()) {
+            UnityDBusWorker::instance()->invokeAndWait([cachedExport]() {
+                delete cachedExport;
+            });
+        } else {
+            delete cachedExport;
+        }
+    }
+    if (m_snapshot) {
+        g_variant_unref(m_snapshot);
+    }
+}
+
+bool UnityMenuCache::isEnabled()
+{
+    QByteArray menuCache = qgetenv("QTUNITY_MENU_CACHE");
+    return !menuCache.isEmpty() && menuCache.at(0) != '0';
+}
+
+// Save a snapshot as the menus of a window, replacing the ones saved before.
+void UnityMenuCache::save(QWindow *window, GVariant *snapshot)
+{
+    const QByteArray fileName = cacheFile(window);
+    gchar *directory = g_path_get_dirname(fileName.constData());
+    g_mkdir_with_parents(directory, 0700);
+    g_free(directory);
+
+    // The snapshot goes behind the file version, as a variant of its own type
+    GVariant *contents = g_variant_ref_sink(g_variant_new("(uv)", guint32(FileVersion), snapshot));
+    GError *error = nullptr;
+    if (!g_file_set_contents(fileName.constData(), static_cast<const gchar*>(g_variant_get_data(contents)),
+                             g_variant_get_size(contents), &error)) {
+        qCWarning(unityappmenu, "Failed to save menus - %s", error ? error->message : "unknown error");
+        g_error_free(error);
+    }
+    g_variant_unref(contents);
+}
+
+QByteArray UnityMenuCache::cacheFile(QWindow *window)
+{
+    // Set by QWidget::setWindowRole until the window is created
+    QString role = window->property("_q_xcb_wm_window_role").toString();
+    if (role.isEmpty()) {
+        role = window->objectName();
+    }
+    if (role.isEmpty()) {
+        role = QStringLiteral("main");
+    }
+
+    return QByteArray(g_get_user_cache_dir()) + "/qtunity-appmenu/" +
+            QFile::encodeName(fileNamePart(QCoreApplication::applicationName()) + QLatin1Char('-') +
+                              fileNamePart(role)) + ".gvariant";
+}
+
+// Export the saved menus, from the worker when there's one.
+void UnityMenuCache::exportOnBus(GDBusConnection *connection)
+{
+    if (m_export) return;
+
+    UnityMenuSnapshotExport *cachedExport = new UnityMenuSnapshotExport(nullptr);
+    const QByteArray menuPath = m_menuPath.toUtf8();
+    GVariant *snapshot = g_variant_ref(m_snapshot);
+    auto exportSnapshot = [cachedExport, connection, menuPath, snapshot]() {
+        cachedExport->apply(snapshot);
+        cachedExport->exportOn(connection, menuPath);
+        g_variant_unref(snapshot);
+    };
+    if (UnityDBusWorker::instance()) {
+        UnityDBusWorker::instance()->invoke(exportSnapshot);
+    } else {
+        exportSnapshot();
+    }
+    m_export = cachedExport;
+    qCDebug(unityappmenu, "Exported saved menus on %s", menuPath.constData());
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2016 Canonical, Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UNITY_MENU_CACHE_H
+#define UNITY_MENU_CACHE_H
+
+#include <QObject>
+#include <QString>
+
+#include <gio/gio.h>
+
+class QWindow;
+class UnityGMenuModelExporter;
+class UnityMenuSnapshotExport;
+
+// The menus last exported for a window, saved in the XDG cache keyed by the
+// application and the window role (see UnityMenuSnapshotBuilder for the format).
+// On the next start the saved snapshot is mapped and exported on a path of
+// its own, without actions nor aboutToShow, until the application populated
+// its menu bar. Enabled with QTUNITY_MENU_CACHE=1.
+class UnityMenuCache : public QObject
+{
+    Q_OBJECT
+public:
+    // Load the menus saved for a window and export them once the bus is ready
+    UnityMenuCache(UnityGMenuModelExporter *exporter, QWindow *window);
+    ~UnityMenuCache();
+
+    static bool isEnabled();
+    static void save(QWindow *window, GVariant *snapshot);
+
+    // False when no menus were saved for the window
+    bool isValid() const { return m_snapshot != nullptr; }
+    QString menuPath() const { return m_menuPath; }
+
+private:
+    // Saved ahead of the snapshot, files of another version are discarded
+    enum { FileVersion = 1 };
+
+    static QByteArray cacheFile(QWindow *window);
+
+    void exportOnBus(GDBusConnection *connection);
+
+    UnityGMenuModelExporter *m_exporter;
+    QString m_menuPath;
+    GVariant *m_snapshot;
+    UnityMenuSnapshotExport *m_export;
+};
+
+#endif // UNITY_MENU_CACHE_H
@@ -16,6 +16,7 @@
 
 #include "menuregistrar.h"
 #include "registry.h"
+#include "sessionbus.h"
 #include "logging.h"
 
 #include <QDebug>
@@ -36,14 +37,16 @@ UnityMenuRegistrar::UnityMenuRegistrar()
     : m_connection(nullptr)
     , m_registeredProcessId(~0)
 {
-    GError *error = NULL;
-    m_connection = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, &error);
-    if (!m_connection) {
-        qCWarning(unityappmenuRegistrar, "Failed to retreive session bus - %s", error ? error->message : "unknown error");
-        g_error_free (error);
-        return;
+    // The registration is queued until the shared session bus is ready
+    UnitySessionBus *bus = UnitySessionBus::instance();
+    bus->acquire();
+    if (bus->connection()) {
+        m_connection = bus->connection();
+        m_service = bus->uniqueName();
+    } else {
+        connect(bus, &UnitySessionBus::ready, this, &UnityMenuRegistrar::busAcquired);
     }
-    m_service = g_dbus_connection_get_unique_name(m_connection);
+
     connect(UnityMenuRegistry::instance(), &UnityMenuRegistry::serviceChanged, this, &UnityMenuRegistrar::onRegistrarServiceChanged);
 
     if (isMirClient()) {
@@ -61,15 +64,21 @@ UnityMenuRegistrar::UnityMenuRegistrar()
 
 UnityMenuRegistrar::~UnityMenuRegistrar()
 {
-    if (m_connection) {
-        g_object_unref(m_connection);
-    }
-    unregisterMenu();
+    unregister();
+}
+
+void UnityMenuRegistrar::busAcquired(GDBusConnection *connection)
+{
+    m_connection = connection;
+    m_service = UnitySessionBus::instance()->uniqueName();
+
+    // Register the menu requested while waiting for the bus
+    registerMenu();
 }
 
 void UnityMenuRegistrar::registerMenuForWindow(QWindow* window, const QDBusObjectPath& path)
 {
-    unregisterMenu();
+    unregister();
 
     m_window = window;
     m_path = path;
@@ -79,7 +88,7 @@ void UnityMenuRegistrar::registerMenuForWindow(QWindow* window, const QDBusObjec
 
 void UnityMenuRegistrar::registerMenu()
 {
-    if (UnityMenuRegistry::instance()->isConnected() && m_window) {
+    if (m_connection && UnityMenuRegistry::instance()->isConnected() && m_window) {
         if (isMirClient()) {
             registerSurfaceMenu();
         } else {
@@ -89,6 +98,13 @@ void UnityMenuRegistrar::registerMenu()
 }
 
 void UnityMenuRegistrar::unregisterMenu()
+{
+    unregister();
+    // Not registered again when the registrar service or the surface changes
+    m_window.clear();
+}
+
+void UnityMenuRegistrar::unregister()
 {
     if (!m_registeredSurfaceId.isEmpty()) {
         unregisterSurfaceMenu();
@@ -132,6 +148,6 @@ void UnityMenuRegistrar::unregisterApplicationMenu()
 
 void UnityMenuRegistrar::onRegistrarServiceChanged()
 {
-    unregisterMenu();
+    unregister();
     registerMenu();
 }
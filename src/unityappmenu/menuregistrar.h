@@ -32,6 +32,7 @@ public:
     ~UnityMenuRegistrar();
 
     void registerMenuForWindow(QWindow* window, const QDBusObjectPath& path);
+    // Unregister the menu and forget its window until it is registered again
     void unregisterMenu();
 
 private Q_SLOTS:
@@ -39,13 +40,16 @@ private Q_SLOTS:
     void onRegistrarServiceChanged();
 
 private:
+    void busAcquired(GDBusConnection *connection);
     void registerMenu();
+    void unregister();
 
     void registerApplicationMenu();
     void unregisterApplicationMenu();
 
     void unregisterSurfaceMenu();
 
+    // Shared session bus, not referenced
     GDBusConnection *m_connection;
     QString m_service;
     QDBusObjectPath m_path;
@@ -0,0 +1,412 @@
+/*
+ * Copyright (C) 2016 Canonical, Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "menusnapshot.h"
+#include "gmenumodelexporter.h"
+#include "logging.h"
+#include "qtunityextraactionhandler.h"
+
+#include <QMetaObject>
+
+#define SNAPSHOT_MODELS_TYPE "a{ta(a{sv}a{st})}"
+#define SNAPSHOT_ITEMS_TYPE "a(a{sv}a{st})"
+#define SNAPSHOT_ACTIONS_TYPE "a{s(bmv)}"
+#define SNAPSHOT_FORMAT "(t@" SNAPSHOT_MODELS_TYPE "@at@" SNAPSHOT_ACTIONS_TYPE "@as)"
+
+UnityMenuSnapshotBuilder::UnityMenuSnapshotBuilder(guint64 rootId, const ModelIds &modelIds)
+    : m_rootId(rootId)
+    , m_modelIds(modelIds)
+{
+    g_variant_builder_init(&m_models, G_VARIANT_TYPE(SNAPSHOT_MODELS_TYPE));
+    g_variant_builder_init(&m_released, G_VARIANT_TYPE("at"));
+    g_variant_builder_init(&m_actions, G_VARIANT_TYPE(SNAPSHOT_ACTIONS_TYPE));
+    g_variant_builder_init(&m_removedActions, G_VARIANT_TYPE("as"));
+}
+
+UnityMenuSnapshotBuilder::~UnityMenuSnapshotBuilder()
+{
+    // Frees what end() didn't
+    g_variant_builder_clear(&m_models);
+    g_variant_builder_clear(&m_released);
+    g_variant_builder_clear(&m_actions);
+    g_variant_builder_clear(&m_removedActions);
+}
+
+void UnityMenuSnapshotBuilder::addModel(GMenuModel *model)
+{
+    GVariantBuilder items;
+    g_variant_builder_init(&items, G_VARIANT_TYPE(SNAPSHOT_ITEMS_TYPE));
+
+    const int count = g_menu_model_get_n_items(model);
+    for (int i = 0; i < count; ++i) {
+        GVariantBuilder attributes;
+        g_variant_builder_init(&attributes, G_VARIANT_TYPE("a{sv}"));
+        GMenuAttributeIter *attributeIter = g_menu_model_iterate_item_attributes(model, i);
+        const gchar *name;
+        GVariant *value;
+        while (g_menu_attribute_iter_get_next(attributeIter, &name, &value)) {
+            g_variant_builder_add(&attributes, "{sv}", name, value);
+            g_variant_unref(value);
+        }
+        g_object_unref(attributeIter);
+
+        GVariantBuilder links;
+        g_variant_builder_init(&links, G_VARIANT_TYPE("a{st}"));
+        GMenuLinkIter *linkIter = g_menu_model_iterate_item_links(model, i);
+        GMenuModel *link;
+        while (g_menu_link_iter_get_next(linkIter, &name, &link)) {
+            g_variant_builder_add(&links, "{st}", name, m_modelIds(link));
+            // Still referenced by its exporter
+            g_object_unref(link);
+        }
+        g_object_unref(linkIter);
+
+        g_variant_builder_add(&items, "(@a{sv}@a{st})",
+                              g_variant_builder_end(&attributes),
+                              g_variant_builder_end(&links));
+    }
+
+    g_variant_builder_add(&m_models, "{t@" SNAPSHOT_ITEMS_TYPE "}", m_modelIds(model), g_variant_builder_end(&items));
+}
+
+void UnityMenuSnapshotBuilder::addReleasedModel(guint64 id)
+{
+    g_variant_builder_add(&m_released, "t", id);
+}
+
+void UnityMenuSnapshotBuilder::addAction(GActionGroup *actions, const gchar *name)
+{
+    gboolean enabled;
+    GVariant *state;
+    if (!g_action_group_query_action(actions, name, &enabled, nullptr, nullptr, nullptr, &state)) {
+        g_variant_builder_add(&m_removedActions, "s", name);
+        return;
+    }
+
+    g_variant_builder_add(&m_actions, "{s(bmv)}", name, enabled, state);
+    if (state) {
+        g_variant_unref(state);
+    }
+}
+
+GVariant *UnityMenuSnapshotBuilder::end()
+{
+    return g_variant_ref_sink(g_variant_new(SNAPSHOT_FORMAT,
+                                            m_rootId,
+                                            g_variant_builder_end(&m_models),
+                                            g_variant_builder_end(&m_released),
+                                            g_variant_builder_end(&m_actions),
+                                            g_variant_builder_end(&m_removedActions)));
+}
+
+// The items of a model without what would reach the application: their action,
+// its target and the tag aboutToShow is sent with.
+static GVariant *inertItems(GVariant *items)
+{
+    GVariantBuilder inert;
+    g_variant_builder_init(&inert, G_VARIANT_TYPE(SNAPSHOT_ITEMS_TYPE));
+    GVariantIter iter;
+    GVariant *attributes;
+    GVariant *links;
+    g_variant_iter_init(&iter, items);
+    while (g_variant_iter_next(&iter, "(@a{sv}@a{st})", &attributes, &links)) {
+        GVariantBuilder kept;
+        g_variant_builder_init(&kept, G_VARIANT_TYPE("a{sv}"));
+        GVariantIter attributeIter;
+        const gchar *name;
+        GVariant *value;
+        g_variant_iter_init(&attributeIter, attributes);
+        while (g_variant_iter_next(&attributeIter, "{&sv}", &name, &value)) {
+            if (g_strcmp0(name, G_MENU_ATTRIBUTE_ACTION) != 0 &&
+                    g_strcmp0(name, G_MENU_ATTRIBUTE_TARGET) != 0 &&
+                    g_strcmp0(name, "qtunity-tag") != 0) {
+                g_variant_builder_add(&kept, "{sv}", name, value);
+            }
+            g_variant_unref(value);
+        }
+        g_variant_builder_add(&inert, "(@a{sv}@a{st})", g_variant_builder_end(&kept), links);
+        g_variant_unref(attributes);
+        g_variant_unref(links);
+    }
+    return g_variant_builder_end(&inert);
+}
+
+GVariant *unityMenuSnapshotInert(GVariant *snapshot)
+{
+    guint64 rootId;
+    GVariant *models;
+    g_variant_get(snapshot, SNAPSHOT_FORMAT, &rootId, &models, nullptr, nullptr, nullptr);
+
+    GVariantBuilder inert;
+    g_variant_builder_init(&inert, G_VARIANT_TYPE(SNAPSHOT_MODELS_TYPE));
+    GVariantIter iter;
+    guint64 id;
+    GVariant *items;
+    g_variant_iter_init(&iter, models);
+    while (g_variant_iter_next(&iter, "{t@" SNAPSHOT_ITEMS_TYPE "}", &id, &items)) {
+        g_variant_builder_add(&inert, "{t@" SNAPSHOT_ITEMS_TYPE "}", id, inertItems(items));
+        g_variant_unref(items);
+    }
+    g_variant_unref(models);
+
+    GVariantBuilder released;
+    g_variant_builder_init(&released, G_VARIANT_TYPE("at"));
+    GVariantBuilder actions;
+    g_variant_builder_init(&actions, G_VARIANT_TYPE(SNAPSHOT_ACTIONS_TYPE));
+    GVariantBuilder removed;
+    g_variant_builder_init(&removed, G_VARIANT_TYPE("as"));
+    return g_variant_ref_sink(g_variant_new(SNAPSHOT_FORMAT, rootId,
+                                            g_variant_builder_end(&inert),
+                                            g_variant_builder_end(&released),
+                                            g_variant_builder_end(&actions),
+                                            g_variant_builder_end(&removed)));
+}
+
+UnityMenuSnapshotExport::UnityMenuSnapshotExport(UnityGMenuModelExporter *exporter)
+    : m_exporter(exporter)
+    , m_connection(nullptr)
+    , m_root(g_menu_new())
+    , m_actionGroup(g_simple_action_group_new())
+    , m_exportedModel(0)
+    , m_exportedActions(0)
+    , m_qtunityExtraHandler(nullptr)
+{
+}
+
+UnityMenuSnapshotExport::~UnityMenuSnapshotExport()
+{
+    unexport();
+
+    Q_FOREACH(GMenu *menu, m_menus) {
+        g_object_unref(menu);
+    }
+    Q_FOREACH(const QVector<GVariant*> &items, m_items) {
+        Q_FOREACH(GVariant *item, items) {
+            g_variant_unref(item);
+        }
+    }
+    g_object_unref(m_root);
+    g_object_unref(m_actionGroup);
+}
+
+// Export the mirrored menus, must be called from the worker so that dbus
+// requests are dispatched in its context.
+void UnityMenuSnapshotExport::exportOn(GDBusConnection *connection, const QByteArray &menuPath)
+{
+    GError *error = nullptr;
+    m_connection = connection;
+
+    m_exportedModel = g_dbus_connection_export_menu_model(m_connection, menuPath.constData(), G_MENU_MODEL(m_root), &error);
+    if (m_exportedModel == 0) {
+        qCWarning(unityappmenu, "Failed to export menu - %s", error ? error->message : "unknown error");
+        g_error_free (error);
+        error = nullptr;
+    }
+
+    m_exportedActions = g_dbus_connection_export_action_group(m_connection, menuPath.constData(), G_ACTION_GROUP(m_actionGroup), &error);
+    if (m_exportedActions == 0) {
+        qCWarning(unityappmenu, "Failed to export actions - %s", error ? error->message : "unknown error");
+        g_error_free (error);
+        error = nullptr;
+    }
+
+    // Nothing to forward aboutToShow to for inert menus
+    if (!m_exporter) return;
+
+    m_qtunityExtraHandler = new QtUnityExtraActionHandler();
+    if (!m_qtunityExtraHandler->connect(m_connection, menuPath, m_exporter)) {
+        delete m_qtunityExtraHandler;
+        m_qtunityExtraHandler = nullptr;
+    }
+}
+
+void UnityMenuSnapshotExport::unexport()
+{
+    if (!m_connection) return;
+
+    if (m_exportedModel != 0) {
+        g_dbus_connection_unexport_menu_model(m_connection, m_exportedModel);
+        m_exportedModel = 0;
+    }
+    if (m_exportedActions != 0) {
+        g_dbus_connection_unexport_action_group(m_connection, m_exportedActions);
+        m_exportedActions = 0;
+    }
+    if (m_qtunityExtraHandler) {
+        m_qtunityExtraHandler->disconnect(m_connection);
+        delete m_qtunityExtraHandler;
+        m_qtunityExtraHandler = nullptr;
+    }
+    m_connection = nullptr;
+}
+
+void UnityMenuSnapshotExport::apply(GVariant *snapshot)
+{
+    guint64 rootId;
+    GVariant *models;
+    GVariant *released;
+    GVariant *actions;
+    GVariant *removed;
+    g_variant_get(snapshot, SNAPSHOT_FORMAT, &rootId, &models, &released, &actions, &removed);
+
+    if (!m_menus.contains(rootId)) {
+        m_menus.insert(rootId, G_MENU(g_object_ref(m_root)));
+    }
+
+    // Released first, ids are not reused
+    GVariantIter iter;
+    guint64 id;
+    g_variant_iter_init(&iter, released);
+    while (g_variant_iter_next(&iter, "t", &id)) {
+        Q_FOREACH(GVariant *item, m_items.take(id)) {
+            g_variant_unref(item);
+        }
+        GMenu *menu = m_menus.take(id);
+        if (menu) {
+            g_object_unref(menu);
+        }
+    }
+
+    GVariant *items;
+    g_variant_iter_init(&iter, models);
+    while (g_variant_iter_next(&iter, "{t@" SNAPSHOT_ITEMS_TYPE "}", &id, &items)) {
+        applyModel(id, items);
+        g_variant_unref(items);
+    }
+
+    applyActions(actions, removed);
+
+    g_variant_unref(models);
+    g_variant_unref(released);
+    g_variant_unref(actions);
+    g_variant_unref(removed);
+}
+
+// The GMenu mirroring a model, empty until the model is part of a snapshot.
+GMenu *UnityMenuSnapshotExport::mirror(guint64 id)
+{
+    GMenu *menu = m_menus.value(id);
+    if (!menu) {
+        menu = g_menu_new();
+        m_menus.insert(id, menu);
+    }
+    return menu;
+}
+
+// Replace the items of a mirrored menu in between the unchanged head and tail.
+void UnityMenuSnapshotExport::applyModel(guint64 id, GVariant *items)
+{
+    GMenu *menu = mirror(id);
+    const QVector<GVariant*> previous = m_items.value(id);
+
+    QVector<GVariant*> current;
+    const int count = g_variant_n_children(items);
+    current.reserve(count);
+    for (int i = 0; i < count; ++i) {
+        current << g_variant_get_child_value(items, i);
+    }
+
+    int head = 0;
+    while (head < previous.count() && head < current.count() &&
+           g_variant_equal(previous.at(head), current.at(head))) {
+        ++head;
+    }
+    int tail = 0;
+    while (tail < previous.count() - head && tail < current.count() - head &&
+           g_variant_equal(previous.at(previous.count() - tail - 1), current.at(current.count() - tail - 1))) {
+        ++tail;
+    }
+
+    for (int i = previous.count() - tail - 1; i >= head; --i) {
+        g_menu_remove(menu, i);
+    }
+    for (int i = head; i < current.count() - tail; ++i) {
+        GVariant *attributes = g_variant_get_child_value(current.at(i), 0);
+        GVariant *links = g_variant_get_child_value(current.at(i), 1);
+
+        GMenuItem *item = g_menu_item_new(nullptr, nullptr);
+        GVariantIter iter;
+        const gchar *name;
+        GVariant *value;
+        g_variant_iter_init(&iter, attributes);
+        while (g_variant_iter_loop(&iter, "{&sv}", &name, &value)) {
+            g_menu_item_set_attribute_value(item, name, value);
+        }
+        guint64 link;
+        g_variant_iter_init(&iter, links);
+        while (g_variant_iter_next(&iter, "{&st}", &name, &link)) {
+            g_menu_item_set_link(item, name, G_MENU_MODEL(mirror(link)));
+        }
+
+        g_menu_insert_item(menu, i, item);
+        g_object_unref(item);
+        g_variant_unref(attributes);
+        g_variant_unref(links);
+    }
+
+    Q_FOREACH(GVariant *item, previous) {
+        g_variant_unref(item);
+    }
+    m_items.insert(id, current);
+}
+
+// Add, update and remove the mirrored actions.
+void UnityMenuSnapshotExport::applyActions(GVariant *actions, GVariant *removed)
+{
+    GVariantIter iter;
+    const gchar *name;
+    gboolean enabled;
+    GVariant *state;
+    g_variant_iter_init(&iter, actions);
+    while (g_variant_iter_next(&iter, "{&s(bmv)}", &name, &enabled, &state)) {
+        GAction *action = g_action_map_lookup_action(G_ACTION_MAP(m_actionGroup), name);
+        if (action && (g_action_get_state_type(action) != nullptr) != (state != nullptr)) {
+            // A stateless action can't become stateful, replace it under the same name
+            g_action_map_remove_action(G_ACTION_MAP(m_actionGroup), name);
+            action = nullptr;
+        }
+
+        if (!action) {
+            GSimpleAction *simpleAction = state ? g_simple_action_new_stateful(name, nullptr, state) :
+                                                  g_simple_action_new(name, nullptr);
+            g_simple_action_set_enabled(simpleAction, enabled);
+            g_signal_connect(simpleAction, "activate", G_CALLBACK(activate_cb), this);
+            g_action_map_add_action(G_ACTION_MAP(m_actionGroup), G_ACTION(simpleAction));
+            g_object_unref(simpleAction);
+        } else {
+            g_simple_action_set_enabled(G_SIMPLE_ACTION(action), enabled);
+            if (state) {
+                g_simple_action_set_state(G_SIMPLE_ACTION(action), state);
+            }
+        }
+
+        if (state) {
+            g_variant_unref(state);
+        }
+    }
+
+    g_variant_iter_init(&iter, removed);
+    while (g_variant_iter_next(&iter, "&s", &name)) {
+        g_action_map_remove_action(G_ACTION_MAP(m_actionGroup), name);
+    }
+}
+
+void UnityMenuSnapshotExport::activate_cb(GSimpleAction *action, GVariant *, gpointer user_data)
+{
+    auto self = static_cast<UnityMenuSnapshotExport*>(user_data);
+    QMetaObject::invokeMethod(self->m_exporter, "activateAction", Qt::QueuedConnection,
+                              Q_ARG(QByteArray, QByteArray(g_action_get_name(G_ACTION(action)))));
+}
@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2016 Canonical, Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UNITY_MENU_SNAPSHOT_H
+#define UNITY_MENU_SNAPSHOT_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QVector>
+
+#include <gio/gio.h>
+
+#include <functional>
+
+class QtUnityExtraActionHandler;
+class UnityGMenuModelExporter;
+
+#define UNITY_MENU_SNAPSHOT_TYPE "(ta{ta(a{sv}a{st})}ata{s(bmv)}as)"
+
+// Builds an immutable snapshot of the changes made to a menu model tree and
+// to its actions, a UNITY_MENU_SNAPSHOT_TYPE variant: the id of the root
+// model, the items of the models that changed with their attributes and the
+// ids of the models they link to, the ids of the models released, the enabled
+// flag and state of the actions that changed and the names of the ones removed.
+// Models are named by the ids their exporter gives them. A snapshot of every
+// model and action describes the whole tree.
+class UnityMenuSnapshotBuilder
+{
+public:
+    typedef std::function<guint64(GMenuModel*)> ModelIds;
+
+    UnityMenuSnapshotBuilder(guint64 rootId, const ModelIds &modelIds);
+    ~UnityMenuSnapshotBuilder();
+
+    // Read the items of a model, the models it links to aren't read
+    void addModel(GMenuModel *model);
+    void addReleasedModel(guint64 id);
+    // Added as removed when the group doesn't have it anymore
+    void addAction(GActionGroup *actions, const gchar *name);
+
+    // The snapshot, with a full reference
+    GVariant *end();
+
+private:
+    guint64 m_rootId;
+    ModelIds m_modelIds;
+    GVariantBuilder m_models;
+    GVariantBuilder m_released;
+    GVariantBuilder m_actions;
+    GVariantBuilder m_removedActions;
+};
+
+// The menus of a snapshot without any action nor aboutToShow tag, so that
+// nothing done on them reaches the application.
+GVariant *unityMenuSnapshotInert(GVariant *snapshot);
+
+// Exports the menu snapshots of an exporter from the dbus worker thread.
+// Apart from its construction, it is only used in the worker context.
+// Activations and aboutToShow are queued to the exporter in the GUI thread,
+// there is none without an exporter.
+class UnityMenuSnapshotExport
+{
+public:
+    UnityMenuSnapshotExport(UnityGMenuModelExporter *exporter);
+    ~UnityMenuSnapshotExport();
+
+    void exportOn(GDBusConnection *connection, const QByteArray &menuPath);
+    void unexport();
+
+    // Apply the changes of a snapshot to the exported menus and actions
+    void apply(GVariant *snapshot);
+
+private:
+    GMenu *mirror(guint64 id);
+    void applyModel(guint64 id, GVariant *items);
+    void applyActions(GVariant *actions, GVariant *removed);
+
+    static void activate_cb(GSimpleAction *action, GVariant *, gpointer user_data);
+
+    UnityGMenuModelExporter *m_exporter;
+    GDBusConnection *m_connection;
+    GMenu *m_root;
+    GSimpleActionGroup *m_actionGroup;
+    guint m_exportedModel;
+    guint m_exportedActions;
+    QtUnityExtraActionHandler *m_qtunityExtraHandler;
+
+    // Snapshot model id -> GMenu mirroring it (holds a reference)
+    QHash<guint64, GMenu*> m_menus;
+    // Snapshot model id -> items last applied to its GMenu (hold a reference)
+    QHash<guint64, QVector<GVariant*>> m_items;
+};
+
+#endif // UNITY_MENU_SNAPSHOT_H
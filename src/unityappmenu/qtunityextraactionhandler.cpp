@@ -25,6 +25,10 @@ static const gchar introspection_xml[] =
   "    <method name='aboutToShow'>"
   "      <arg type='t' name='tag' direction='in'/>"
   "    </method>"
+  "    <method name='counters'>"
+  "      <arg type='a{sx}' name='exporter' direction='out'/>"
+  "      <arg type='a{sx}' name='process' direction='out'/>"
+  "    </method>"
   "  </interface>"
   "</node>";
 
@@ -49,6 +53,13 @@ static void handle_method_call (GDBusConnection       *,
         }
 
         g_dbus_method_invocation_return_value (invocation, NULL);
+    } else if (g_strcmp0 (method_name, "counters") == 0) {
+        auto obj = static_cast<UnityGMenuModelExporter*>(user_data);
+
+        g_dbus_method_invocation_return_value (invocation,
+                                               g_variant_new ("(@a{sx}@a{sx})",
+                                                              obj->counters().toVariant(),
+                                                              UnityExporterCounters::process()->toVariant()));
     } else {
         g_dbus_method_invocation_return_error(invocation,
                                               G_DBUS_ERROR,
@@ -15,16 +15,18 @@
  */
 
 #include "registry.h"
+#include "sessionbus.h"
 #include "logging.h"
-#include "menuregistrar_interface.h"
 
 #include <QDBusObjectPath>
-#include <QDBusServiceWatcher>
+#include <QScopedPointer>
+#include <QTimer>
 
 Q_LOGGING_CATEGORY(unityappmenuRegistrar, "unityappmenu.registrar", QtWarningMsg)
 
 #define REGISTRAR_SERVICE "io.unity8.MenuRegistrar"
 #define REGISTRY_OBJECT_PATH "/io/unity8/MenuRegistrar"
+#define REGISTRAR_INTERFACE "io.unity8.MenuRegistrar"
 
 UnityMenuRegistry *UnityMenuRegistry::instance()
 {
@@ -34,15 +36,271 @@ UnityMenuRegistry *UnityMenuRegistry::instance()
 
 UnityMenuRegistry::UnityMenuRegistry(QObject* parent)
     : QObject(parent)
-    , m_serviceWatcher(new QDBusServiceWatcher(REGISTRAR_SERVICE, QDBusConnection::sessionBus(), QDBusServiceWatcher::WatchForOwnerChange, this))
-    , m_interface(new IoUnity8MenuRegistrarInterface(REGISTRAR_SERVICE, REGISTRY_OBJECT_PATH, QDBusConnection::sessionBus(), this))
-    , m_connected(m_interface->isValid())
+    , m_connection(nullptr)
+    , m_serviceWatcher(0)
+    , m_connected(false)
+    , m_batchSupported(true)
 {
-    connect(m_serviceWatcher.data(), &QDBusServiceWatcher::serviceOwnerChanged, this, &UnityMenuRegistry::serviceOwnerChanged);
+    m_flushTimer.setSingleShot(true);
+    m_flushTimer.setInterval(0);
+    connect(&m_flushTimer, &QTimer::timeout, this, &UnityMenuRegistry::flushCalls);
+
+    // The registrar is called on the bus the menus are exported on
+    UnitySessionBus *bus = UnitySessionBus::instance();
+    bus->acquire();
+    if (bus->connection()) {
+        busAcquired(bus->connection());
+    } else {
+        connect(bus, &UnitySessionBus::ready, this, &UnityMenuRegistry::busAcquired);
+    }
 }
 
 UnityMenuRegistry::~UnityMenuRegistry()
 {
+    if (m_serviceWatcher != 0) {
+        g_bus_unwatch_name(m_serviceWatcher);
+    }
+}
+
+void UnityMenuRegistry::busAcquired(GDBusConnection *connection)
+{
+    m_connection = connection;
+    m_serviceWatcher = g_bus_watch_name_on_connection(m_connection, REGISTRAR_SERVICE, G_BUS_NAME_WATCHER_FLAGS_NONE,
+        [](GDBusConnection *, const gchar *, const gchar *nameOwner, gpointer user_data) {
+            static_cast<UnityMenuRegistry*>(user_data)->serviceOwnerChanged(QString::fromUtf8(nameOwner));
+        },
+        [](GDBusConnection *, const gchar *, gpointer user_data) {
+            static_cast<UnityMenuRegistry*>(user_data)->serviceOwnerChanged(QString());
+        },
+        this, nullptr);
+
+    // Send what was queued before the bus was there
+    if (!m_pendingCalls.isEmpty()) {
+        m_flushTimer.start();
+    }
+}
+
+QByteArray UnityMenuRegistry::RegistrarCall::key() const
+{
+    return (surface ? "surface:" + surfaceId : "pid:" + QByteArray::number(pid)) + ' ' + path;
+}
+
+void UnityMenuRegistry::queueCall(const RegistrarCall &call)
+{
+    // A later call for the same menu supersedes the pending one
+    m_pendingCalls.insert(call.key(), call);
+    m_flushTimer.start();
+}
+
+// Send the calls queued during the last event loop iteration.
+// Calls leaving a menu in the state the registrar already knows it in, like
+// an unregistration followed by the same registration, are dropped.
+void UnityMenuRegistry::flushCalls()
+{
+    QVector<RegistrarCall> calls;
+    for (auto it = m_pendingCalls.constBegin(); it != m_pendingCalls.constEnd(); ++it) {
+        const RegistrarCall &call = it.value();
+        auto registered = m_registeredMenus.constFind(it.key());
+        if (call.registration) {
+            if (registered != m_registeredMenus.constEnd() && *registered == call.service) continue;
+        } else {
+            if (registered == m_registeredMenus.constEnd()) continue;
+        }
+        calls << call;
+    }
+    m_pendingCalls.clear();
+
+    qCDebug(unityappmenuRegistrar, "UnityMenuRegistry::flushCalls(calls=%d)", calls.count());
+    if (calls.isEmpty()) return;
+
+    if (calls.count() == 1 || !m_batchSupported) {
+        // Unregistrations first, as in a batch
+        Q_FOREACH(const RegistrarCall &call, calls) {
+            if (!call.registration) sendCall(call);
+        }
+        Q_FOREACH(const RegistrarCall &call, calls) {
+            if (call.registration) sendCall(call);
+        }
+    } else {
+        sendBatch(calls);
+    }
+}
+
+void UnityMenuRegistry::sendCall(const RegistrarCall &call, int attempt)
+{
+    GVariant *parameters;
+    const char *method;
+    if (call.surface && call.registration) {
+        method = "RegisterSurfaceMenu";
+        parameters = g_variant_new("(soos)", call.surfaceId.constData(),
+                                   call.path.constData(), call.path.constData(), call.service.constData());
+    } else if (call.surface) {
+        method = "UnregisterSurfaceMenu";
+        parameters = g_variant_new("(so)", call.surfaceId.constData(), call.path.constData());
+    } else if (call.registration) {
+        method = "RegisterAppMenu";
+        parameters = g_variant_new("(uoos)", call.pid,
+                                   call.path.constData(), call.path.constData(), call.service.constData());
+    } else {
+        method = "UnregisterAppMenu";
+        parameters = g_variant_new("(uo)", call.pid, call.path.constData());
+    }
+    callRegistrar(method, parameters, QVector<RegistrarCall>() << call, attempt);
+}
+
+// Send all the calls at once with RegisterMenus, falling back to a call per
+// menu if the registrar doesn't implement it.
+void UnityMenuRegistry::sendBatch(const QVector<RegistrarCall> &calls, int attempt)
+{
+    GVariantBuilder appMenus, surfaceMenus, unregisteredAppMenus, unregisteredSurfaceMenus;
+    g_variant_builder_init(&appMenus, G_VARIANT_TYPE("a(uoos)"));
+    g_variant_builder_init(&surfaceMenus, G_VARIANT_TYPE("a(soos)"));
+    g_variant_builder_init(&unregisteredAppMenus, G_VARIANT_TYPE("a(uo)"));
+    g_variant_builder_init(&unregisteredSurfaceMenus, G_VARIANT_TYPE("a(so)"));
+    Q_FOREACH(const RegistrarCall &call, calls) {
+        if (call.surface && call.registration) {
+            g_variant_builder_add(&surfaceMenus, "(soos)", call.surfaceId.constData(),
+                                  call.path.constData(), call.path.constData(), call.service.constData());
+        } else if (call.surface) {
+            g_variant_builder_add(&unregisteredSurfaceMenus, "(so)", call.surfaceId.constData(), call.path.constData());
+        } else if (call.registration) {
+            g_variant_builder_add(&appMenus, "(uoos)", call.pid,
+                                  call.path.constData(), call.path.constData(), call.service.constData());
+        } else {
+            g_variant_builder_add(&unregisteredAppMenus, "(uo)", call.pid, call.path.constData());
+        }
+    }
+
+    callRegistrar("RegisterMenus",
+                  g_variant_new("(@a(uoos)@a(soos)@a(uo)@a(so))",
+                                g_variant_builder_end(&appMenus),
+                                g_variant_builder_end(&surfaceMenus),
+                                g_variant_builder_end(&unregisteredAppMenus),
+                                g_variant_builder_end(&unregisteredSurfaceMenus)),
+                  calls, attempt);
+}
+
+// Call the registrar and watch for its reply, to record the call latency and
+// errors and to retry calls failing for a transient reason.
+// The registered menus are updated once the call is sent; without a bus the
+// calls are queued again, unless superseded, for when it is acquired.
+void UnityMenuRegistry::callRegistrar(const char *method, GVariant *parameters,
+                                      const QVector<RegistrarCall> &calls, int attempt)
+{
+    if (!m_connection) {
+        g_variant_unref(g_variant_ref_sink(parameters));
+        Q_FOREACH(const RegistrarCall &call, calls) {
+            const QByteArray key = call.key();
+            if (!m_pendingCalls.contains(key)) {
+                m_pendingCalls.insert(key, call);
+            }
+        }
+        return;
+    }
+
+    PendingReply *pending = new PendingReply;
+    pending->method = method;
+    pending->calls = calls;
+    pending->attempt = attempt;
+    pending->elapsed.start();
+
+    g_dbus_connection_call(m_connection, REGISTRAR_SERVICE, REGISTRY_OBJECT_PATH, REGISTRAR_INTERFACE,
+                           method, parameters, nullptr, G_DBUS_CALL_FLAGS_NONE, -1, nullptr,
+                           [](GObject *source, GAsyncResult *res, gpointer user_data) {
+        QScopedPointer<PendingReply> pending(static_cast<PendingReply*>(user_data));
+
+        GError *error = nullptr;
+        GVariant *reply = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), res, &error);
+        if (reply) {
+            g_variant_unref(reply);
+        }
+        UnityMenuRegistry::instance()->replyReceived(*pending, error);
+        if (error) {
+            g_error_free(error);
+        }
+    }, pending);
+
+    Q_FOREACH(const RegistrarCall &call, calls) {
+        if (call.registration) {
+            m_registeredMenus.insert(call.key(), call.service);
+        } else {
+            m_registeredMenus.remove(call.key());
+        }
+    }
+}
+
+void UnityMenuRegistry::replyReceived(const PendingReply &pending, GError *error)
+{
+    const qint64 latency = pending.elapsed.nsecsElapsed() / 1000;
+    CallStats &stats = m_callStats[pending.method];
+    ++stats.calls;
+    stats.totalLatency += latency;
+    stats.maxLatency = qMax(stats.maxLatency, latency);
+
+    if (!error) {
+        qCDebug(unityappmenuRegistrar, "%s replied after %lld us, %lld us on average and %lld us at most over %llu calls",
+                pending.method.constData(), latency, stats.totalLatency / qint64(stats.calls), stats.maxLatency, stats.calls);
+        return;
+    }
+
+    if (pending.method == "RegisterMenus" && g_error_matches(error, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD)) {
+        qCDebug(unityappmenuRegistrar, "Registrar doesn't support RegisterMenus, sending calls one by one");
+        m_batchSupported = false;
+        Q_FOREACH(const RegistrarCall &call, pending.calls) {
+            if (!call.registration) sendCall(call);
+        }
+        Q_FOREACH(const RegistrarCall &call, pending.calls) {
+            if (call.registration) sendCall(call);
+        }
+        return;
+    }
+
+    ++stats.errors;
+
+    // Only retry the calls still reflecting what we want the registrar to know
+    QVector<RegistrarCall> calls;
+    Q_FOREACH(const RegistrarCall &call, pending.calls) {
+        const QByteArray key = call.key();
+        if (m_pendingCalls.contains(key)) continue;
+        auto registered = m_registeredMenus.constFind(key);
+        if (call.registration ? (registered != m_registeredMenus.constEnd() && *registered == call.service)
+                              : (registered == m_registeredMenus.constEnd())) {
+            calls << call;
+        }
+    }
+
+    const bool transient = g_error_matches(error, G_DBUS_ERROR, G_DBUS_ERROR_NO_REPLY) ||
+                           g_error_matches(error, G_DBUS_ERROR, G_DBUS_ERROR_TIMEOUT) ||
+                           g_error_matches(error, G_DBUS_ERROR, G_DBUS_ERROR_TIMED_OUT) ||
+                           g_error_matches(error, G_DBUS_ERROR, G_DBUS_ERROR_LIMITS_EXCEEDED) ||
+                           g_error_matches(error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT);
+    if (transient && pending.attempt < MaxCallAttempts && !calls.isEmpty()) {
+        ++stats.retries;
+        const int delay = CallRetryDelay << (pending.attempt - 1);
+        qCDebug(unityappmenuRegistrar, "%s failed - %s, retrying in %d ms",
+                pending.method.constData(), error->message, delay);
+
+        const QByteArray method = pending.method;
+        const int attempt = pending.attempt + 1;
+        QTimer::singleShot(delay, this, [this, method, calls, attempt]() {
+            if (method == "RegisterMenus") {
+                sendBatch(calls, attempt);
+            } else {
+                sendCall(calls.first(), attempt);
+            }
+        });
+        return;
+    }
+
+    qCWarning(unityappmenuRegistrar, "%s failed after %d attempts - %s, %llu errors and %llu retries over %llu calls",
+              pending.method.constData(), pending.attempt, error->message, stats.errors, stats.retries, stats.calls);
+
+    // The registrar may not know these menus, don't take a later registration for a no-op
+    Q_FOREACH(const RegistrarCall &call, calls) {
+        if (call.registration) {
+            m_registeredMenus.remove(call.key());
+        }
+    }
 }
 
 void UnityMenuRegistry::registerApplicationMenu(pid_t pid, QDBusObjectPath menuObjectPath, const QString &service)
@@ -52,16 +310,24 @@ void UnityMenuRegistry::registerApplicationMenu(pid_t pid, QDBusObjectPath menuO
             qPrintable(menuObjectPath.path()),
             qPrintable(service));
 
-    m_interface->RegisterAppMenu(pid, menuObjectPath, menuObjectPath, service);
+    RegistrarCall call;
+    call.registration = true;
+    call.pid = pid;
+    call.path = menuObjectPath.path().toUtf8();
+    call.service = service.toUtf8();
+    queueCall(call);
 }
 
 void UnityMenuRegistry::unregisterApplicationMenu(pid_t pid, QDBusObjectPath menuObjectPath)
 {
-    qCDebug(unityappmenuRegistrar, "UnityMenuRegistry::unregisterSurfaceMenu(pid=%d, menuObjectPath=%s)",
+    qCDebug(unityappmenuRegistrar, "UnityMenuRegistry::unregisterApplicationMenu(pid=%d, menuObjectPath=%s)",
             pid,
             qPrintable(menuObjectPath.path()));
 
-    m_interface->UnregisterAppMenu(pid, menuObjectPath);
+    RegistrarCall call;
+    call.pid = pid;
+    call.path = menuObjectPath.path().toUtf8();
+    queueCall(call);
 }
 
 void UnityMenuRegistry::registerSurfaceMenu(const QString &surfaceId, QDBusObjectPath menuObjectPath, const QString &service)
@@ -71,7 +337,13 @@ void UnityMenuRegistry::registerSurfaceMenu(const QString &surfaceId, QDBusObjec
             qPrintable(menuObjectPath.path()),
             qPrintable(service));
 
-    m_interface->RegisterSurfaceMenu(surfaceId, menuObjectPath, menuObjectPath, service);
+    RegistrarCall call;
+    call.surface = true;
+    call.registration = true;
+    call.surfaceId = surfaceId.toUtf8();
+    call.path = menuObjectPath.path().toUtf8();
+    call.service = service.toUtf8();
+    queueCall(call);
 }
 
 void UnityMenuRegistry::unregisterSurfaceMenu(const QString &surfaceId, QDBusObjectPath menuObjectPath)
@@ -80,18 +352,25 @@ void UnityMenuRegistry::unregisterSurfaceMenu(const QString &surfaceId, QDBusObj
             qPrintable(surfaceId),
             qPrintable(menuObjectPath.path()));
 
-    m_interface->UnregisterSurfaceMenu(surfaceId, menuObjectPath);
+    RegistrarCall call;
+    call.surface = true;
+    call.surfaceId = surfaceId.toUtf8();
+    call.path = menuObjectPath.path().toUtf8();
+    queueCall(call);
 }
 
-
-void UnityMenuRegistry::serviceOwnerChanged(const QString &serviceName, const QString& oldOwner, const QString &newOwner)
+void UnityMenuRegistry::serviceOwnerChanged(const QString &newOwner)
 {
     qCDebug(unityappmenuRegistrar, "UnityMenuRegistry::serviceOwnerChanged(newOwner=%s)", qPrintable(newOwner));
 
-    if (serviceName != REGISTRAR_SERVICE) return;
+    const bool connected = !newOwner.isEmpty();
+    // Not running before and still not running isn't a change
+    if (!connected && !m_connected) return;
 
-    if (oldOwner != newOwner) {
-        m_connected = !newOwner.isEmpty();
-        Q_EMIT serviceChanged();
-    }
+    // A new registrar knows nothing about our menus, nor what it supports
+    m_registeredMenus.clear();
+    m_batchSupported = true;
+
+    m_connected = connected;
+    Q_EMIT serviceChanged();
 }
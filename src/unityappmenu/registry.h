@@ -18,11 +18,15 @@
 #define UNITY_MENU_REGISTRY_H
 
 #include <QObject>
-#include <QScopedPointer>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QMap>
+#include <QTimer>
+#include <QVector>
+
+#include <gio/gio.h>
 
-class IoUnity8MenuRegistrarInterface;
 class QDBusObjectPath;
-class QDBusServiceWatcher;
 
 class UnityMenuRegistry : public QObject
 {
@@ -44,13 +48,63 @@ public:
 Q_SIGNALS:
     void serviceChanged();
 
-private Q_SLOTS:
-    void serviceOwnerChanged(const QString &serviceName, const QString& oldOwner, const QString &newOwner);
-
 private:
-    QScopedPointer<QDBusServiceWatcher> m_serviceWatcher;
-    QScopedPointer<IoUnity8MenuRegistrarInterface> m_interface;
+    // A registration or unregistration of a menu, for a process or a surface
+    struct RegistrarCall {
+        bool surface = false;
+        bool registration = false;
+        quint32 pid = 0;
+        QByteArray surfaceId;
+        QByteArray path;
+        QByteArray service;
+
+        QByteArray key() const;
+    };
+
+    // Replies to the calls of a registrar method, latencies in microseconds
+    struct CallStats {
+        quint64 calls = 0;
+        quint64 errors = 0;
+        quint64 retries = 0;
+        qint64 totalLatency = 0;
+        qint64 maxLatency = 0;
+    };
+
+    // A call waiting for the registrar reply
+    struct PendingReply {
+        QByteArray method;
+        QVector<RegistrarCall> calls;
+        int attempt;
+        QElapsedTimer elapsed;
+    };
+
+    // Transient failures are retried after 100, 200 and 400ms
+    enum { MaxCallAttempts = 4, CallRetryDelay = 100 };
+
+    void busAcquired(GDBusConnection *connection);
+    void serviceOwnerChanged(const QString &newOwner);
+
+    void queueCall(const RegistrarCall &call);
+    void flushCalls();
+    void sendCall(const RegistrarCall &call, int attempt = 1);
+    void sendBatch(const QVector<RegistrarCall> &calls, int attempt = 1);
+    void callRegistrar(const char *method, GVariant *parameters, const QVector<RegistrarCall> &calls, int attempt);
+    void replyReceived(const PendingReply &pending, GError *error);
+
+    // Shared session bus, not referenced
+    GDBusConnection *m_connection;
+    guint m_serviceWatcher;
     bool m_connected;
+    // Whether the registrar implements RegisterMenus, assumed until it fails
+    bool m_batchSupported;
+
+    // Calls are sent once per event loop iteration, only the last one per menu
+    QTimer m_flushTimer;
+    QMap<QByteArray, RegistrarCall> m_pendingCalls;
+    // Menus the registrar was told about -> service they were registered with
+    QHash<QByteArray, QByteArray> m_registeredMenus;
+
+    QHash<QByteArray, CallStats> m_callStats;
 };
 
 #endif // UNITY_MENU_REGISTRY_H
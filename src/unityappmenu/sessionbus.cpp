@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2016 Canonical, Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sessionbus.h"
+#include "logging.h"
+
+#include <QTimer>
+
+UnitySessionBus *UnitySessionBus::instance()
+{
+    static UnitySessionBus* bus(new UnitySessionBus());
+    return bus;
+}
+
+UnitySessionBus::UnitySessionBus()
+    : m_connection(nullptr)
+    , m_requested(false)
+    , m_retryDelay(RetryDelay)
+{
+}
+
+UnitySessionBus::~UnitySessionBus()
+{
+    if (m_connection) {
+        g_object_unref(m_connection);
+    }
+}
+
+QString UnitySessionBus::uniqueName() const
+{
+    if (!m_connection) return QString();
+    return QString::fromUtf8(g_dbus_connection_get_unique_name(m_connection));
+}
+
+void UnitySessionBus::acquire()
+{
+    if (m_connection || m_requested) return;
+
+    m_requestTime.start();
+    request();
+}
+
+void UnitySessionBus::request()
+{
+    m_requested = true;
+
+    // The singleton is never destroyed, no need to cancel the request
+    g_bus_get(G_BUS_TYPE_SESSION, nullptr, [](GObject *, GAsyncResult *res, gpointer user_data) {
+        GError *error = nullptr;
+        GDBusConnection *connection = g_bus_get_finish(res, &error);
+        auto self = static_cast<UnitySessionBus*>(user_data);
+        if (!connection) {
+            self->busFailed(error);
+            g_error_free(error);
+            return;
+        }
+        self->busAcquired(connection);
+    }, this);
+}
+
+void UnitySessionBus::busAcquired(GDBusConnection *connection)
+{
+    // Until now every export and registration was queued
+    qCDebug(unityappmenu, "Session bus %s ready after %lld ms",
+            g_dbus_connection_get_unique_name(connection), m_requestTime.elapsed());
+
+    m_connection = connection;
+    m_retryDelay = RetryDelay;
+    Q_EMIT ready(m_connection);
+}
+
+void UnitySessionBus::busFailed(GError *error)
+{
+    qCWarning(unityappmenu, "Failed to retreive session bus - %s, retrying in %d ms",
+              error ? error->message : "unknown error", m_retryDelay);
+
+    QTimer::singleShot(m_retryDelay, this, &UnitySessionBus::request);
+    m_retryDelay = qMin(m_retryDelay * 2, int(MaxRetryDelay));
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2016 Canonical, Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UNITY_SESSION_BUS_H
+#define UNITY_SESSION_BUS_H
+
+#include <QObject>
+#include <QElapsedTimer>
+
+#include <gio/gio.h>
+
+// Owns the session bus connection shared by all the exporters, registrars and
+// the registry of the process.
+// The bus is acquired asynchronously when first asked for and kept until the
+// process exits, so windows and popups coming and going never look it up
+// again. The connection handed out is borrowed, users don't ref it.
+class UnitySessionBus : public QObject
+{
+    Q_OBJECT
+public:
+    static UnitySessionBus *instance();
+
+    // nullptr until the bus is ready
+    GDBusConnection *connection() const { return m_connection; }
+    QString uniqueName() const;
+
+    // Start acquiring the bus unless it is ready or on its way.
+    // Failed requests are retried until one succeeds.
+    void acquire();
+
+Q_SIGNALS:
+    void ready(GDBusConnection *connection);
+
+private:
+    UnitySessionBus();
+    ~UnitySessionBus();
+
+    // Failed requests are retried after 100ms, doubling up to 10s
+    enum { RetryDelay = 100, MaxRetryDelay = 10000 };
+
+    void request();
+    void busAcquired(GDBusConnection *connection);
+    void busFailed(GError *error);
+
+    GDBusConnection *m_connection;
+    bool m_requested;
+    int m_retryDelay;
+    QElapsedTimer m_requestTime;
+};
+
+#endif // UNITY_SESSION_BUS_H
@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2016 Canonical, Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UNITY_TRACEPOINTS_H
+#define UNITY_TRACEPOINTS_H
+
+// Static tracepoints of the export pipeline, in the qtunityappmenu provider.
+// When built with CONFIG+=tracepoints they are USDT probes (sys/sdt.h), a nop
+// until perf or bpftrace attach to them, e.g.
+//   bpftrace -e 'usdt:/path/to/libunityappmenu.so:qtunityappmenu:reload_start { @[arg1] = count(); }'
+// Otherwise they compile to nothing, their arguments aren't even evaluated.
+#ifdef QTUNITY_TRACEPOINTS
+
+#include <sys/sdt.h>
+
+#define UNITY_TRACE(name) DTRACE_PROBE(qtunityappmenu, name)
+#define UNITY_TRACE1(name, a1) DTRACE_PROBE1(qtunityappmenu, name, a1)
+#define UNITY_TRACE2(name, a1, a2) DTRACE_PROBE2(qtunityappmenu, name, a1, a2)
+#define UNITY_TRACE3(name, a1, a2, a3) DTRACE_PROBE3(qtunityappmenu, name, a1, a2, a3)
+
+#else
+
+#define UNITY_TRACE(name) do {} while (0)
+#define UNITY_TRACE1(name, a1) do { (void)sizeof(a1); } while (0)
+#define UNITY_TRACE2(name, a1, a2) do { (void)sizeof(a1); (void)sizeof(a2); } while (0)
+#define UNITY_TRACE3(name, a1, a2, a3) do { (void)sizeof(a1); (void)sizeof(a2); (void)sizeof(a3); } while (0)
+
+#endif
+
+#endif // UNITY_TRACEPOINTS_H
@@ -0,0 +1,44 @@
+# Sources of the menu export, shared by the plugin and the tests building it in
+
+INCLUDEPATH += $$PWD
+
+# USDT tracepoints for perf and bpftrace, needs sys/sdt.h (systemtap-sdt-dev)
+tracepoints {
+    DEFINES += QTUNITY_TRACEPOINTS
+}
+
+HEADERS += \
+    $$PWD/theme.h \
+    $$PWD/contextmenupool.h \
+    $$PWD/dbusworker.h \
+    $$PWD/exportercounters.h \
+    $$PWD/gmenumodelexporter.h \
+    $$PWD/gmenumodelplatformmenu.h \
+    $$PWD/iconcache.h \
+    $$PWD/logging.h \
+    $$PWD/menucache.h \
+    $$PWD/menuregistrar.h \
+    $$PWD/menusnapshot.h \
+    $$PWD/registry.h \
+    $$PWD/sessionbus.h \
+    $$PWD/tracepoints.h \
+    $$PWD/qtunityextraactionhandler.h \
+    $$PWD/unitymenumodel.h \
+    $$PWD/updatescheduler.h
+
+SOURCES += \
+    $$PWD/theme.cpp \
+    $$PWD/contextmenupool.cpp \
+    $$PWD/dbusworker.cpp \
+    $$PWD/exportercounters.cpp \
+    $$PWD/gmenumodelexporter.cpp \
+    $$PWD/gmenumodelplatformmenu.cpp \
+    $$PWD/iconcache.cpp \
+    $$PWD/menucache.cpp \
+    $$PWD/menuregistrar.cpp \
+    $$PWD/menusnapshot.cpp \
+    $$PWD/registry.cpp \
+    $$PWD/sessionbus.cpp \
+    $$PWD/qtunityextraactionhandler.cpp \
+    $$PWD/unitymenumodel.cpp \
+    $$PWD/updatescheduler.cpp
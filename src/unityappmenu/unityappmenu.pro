@@ -13,29 +13,17 @@ QMAKE_LFLAGS += -std=c++11 -Wl,-no-undefined
 CONFIG += link_pkgconfig
 PKGCONFIG += gio-2.0
 
-DBUS_INTERFACES += io.unity8.MenuRegistrar.xml
+include(unityappmenu.pri)
 
 HEADERS += \
-    theme.h \
-    gmenumodelexporter.h \
-    gmenumodelplatformmenu.h \
-    logging.h \
-    menuregistrar.h \
-    registry.h \
     themeplugin.h \
-    qtunityextraactionhandler.h \
     ../shared/unitytheme.h
 
 SOURCES += \
-    theme.cpp \
-    gmenumodelexporter.cpp \
-    gmenumodelplatformmenu.cpp \
-    menuregistrar.cpp \
-    registry.cpp \
-    themeplugin.cpp \
-    qtunityextraactionhandler.cpp
+    themeplugin.cpp
 
 OTHER_FILES += \
+    io.unity8.MenuRegistrar.xml \
     unityappmenu.json
 
 # Installation path
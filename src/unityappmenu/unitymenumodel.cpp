@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2016 Canonical, Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "unitymenumodel.h"
+
+#include "gmenumodelexporter.h"
+
+struct _UnityMenuModel
+{
+    GMenuModel parent_instance;
+    UnityGMenuModelExporter *exporter;
+};
+
+typedef GMenuModelClass UnityMenuModelClass;
+
+G_DEFINE_TYPE(UnityMenuModel, unity_menu_model, G_TYPE_MENU_MODEL)
+
+static gboolean unity_menu_model_is_mutable(GMenuModel *)
+{
+    return TRUE;
+}
+
+static gint unity_menu_model_get_n_items(GMenuModel *model)
+{
+    UnityMenuModel *self = UNITY_MENU_MODEL(model);
+    return self->exporter ? self->exporter->itemCount(self) : 0;
+}
+
+static void unity_menu_model_get_item_attributes(GMenuModel *model, gint position, GHashTable **attributes)
+{
+    UnityMenuModel *self = UNITY_MENU_MODEL(model);
+    *attributes = g_hash_table_new_full(g_str_hash, g_str_equal, nullptr,
+                                        reinterpret_cast<GDestroyNotify>(g_variant_unref));
+    if (self->exporter) {
+        self->exporter->itemAttributes(self, position, *attributes);
+    }
+}
+
+static void unity_menu_model_get_item_links(GMenuModel *model, gint position, GHashTable **links)
+{
+    UnityMenuModel *self = UNITY_MENU_MODEL(model);
+    *links = g_hash_table_new_full(g_str_hash, g_str_equal, nullptr, g_object_unref);
+    if (self->exporter) {
+        self->exporter->itemLinks(self, position, *links);
+    }
+}
+
+static void unity_menu_model_init(UnityMenuModel *self)
+{
+    self->exporter = nullptr;
+}
+
+static void unity_menu_model_class_init(UnityMenuModelClass *klass)
+{
+    klass->is_mutable = unity_menu_model_is_mutable;
+    klass->get_n_items = unity_menu_model_get_n_items;
+    klass->get_item_attributes = unity_menu_model_get_item_attributes;
+    klass->get_item_links = unity_menu_model_get_item_links;
+}
+
+UnityMenuModel *unity_menu_model_new(UnityGMenuModelExporter *exporter)
+{
+    UnityMenuModel *model = UNITY_MENU_MODEL(g_object_new(UNITY_TYPE_MENU_MODEL, nullptr));
+    model->exporter = exporter;
+    return model;
+}
+
+void unity_menu_model_detach(UnityMenuModel *model)
+{
+    model->exporter = nullptr;
+}
@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2016 Canonical, Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UNITYMENUMODEL_H
+#define UNITYMENUMODEL_H
+
+#include <gio/gio.h>
+
+class UnityGMenuModelExporter;
+
+// A GMenuModel which doesn't copy the menu into GMenuItems. Its item count,
+// attributes and links are read from the platform menus by its exporter
+// whenever the model is read.
+typedef struct _UnityMenuModel UnityMenuModel;
+
+#define UNITY_TYPE_MENU_MODEL (unity_menu_model_get_type())
+#define UNITY_MENU_MODEL(o) (G_TYPE_CHECK_INSTANCE_CAST((o), UNITY_TYPE_MENU_MODEL, UnityMenuModel))
+
+GType unity_menu_model_get_type();
+
+UnityMenuModel *unity_menu_model_new(UnityGMenuModelExporter *exporter);
+
+// Stop reading from the exporter, the model is empty from now on.
+void unity_menu_model_detach(UnityMenuModel *model);
+
+#endif // UNITYMENUMODEL_H
@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2016 Canonical, Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "updatescheduler.h"
+#include "gmenumodelexporter.h"
+#include "logging.h"
+#include "tracepoints.h"
+
+#include <QElapsedTimer>
+
+#include <algorithm>
+
+namespace {
+
+int intFromEnv(const char *name, int defaultValue) {
+    bool ok;
+    const int value = qEnvironmentVariableIntValue(name, &ok);
+    return ok && value >= 0 ? value : defaultValue;
+}
+
+} // namespace
+
+UnityMenuUpdateScheduler *UnityMenuUpdateScheduler::instance()
+{
+    static UnityMenuUpdateScheduler* scheduler(new UnityMenuUpdateScheduler());
+    return scheduler;
+}
+
+UnityMenuUpdateScheduler::UnityMenuUpdateScheduler()
+    : m_debounce(intFromEnv("QTUNITY_MENU_UPDATE_DEBOUNCE", 0))
+    , m_budget(intFromEnv("QTUNITY_MENU_UPDATE_BUDGET", 0))
+{
+    m_flushTimer.setSingleShot(true);
+    connect(&m_flushTimer, &QTimer::timeout, this, &UnityMenuUpdateScheduler::flush);
+}
+
+void UnityMenuUpdateScheduler::schedule(UnityGMenuModelExporter *exporter, UnityPlatformMenu *menu, UnityMenuReloadCause cause)
+{
+    UNITY_TRACE2(reload_scheduled, quint64(menu->tag()), int(cause));
+    m_pending[Update(exporter, menu)] |= cause;
+
+    // The window starts with the first change, later ones don't push the flush back
+    if (!m_flushTimer.isActive()) {
+        m_flushTimer.start(m_debounce);
+    }
+}
+
+void UnityMenuUpdateScheduler::cancel(UnityGMenuModelExporter *exporter, UnityPlatformMenu *menu)
+{
+    m_pending.remove(Update(exporter, menu));
+}
+
+void UnityMenuUpdateScheduler::cancelAll(UnityGMenuModelExporter *exporter)
+{
+    for (auto it = m_pending.begin(); it != m_pending.end();) {
+        if (it->first == exporter) {
+            it = m_pending.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void UnityMenuUpdateScheduler::flush()
+{
+    QElapsedTimer elapsed;
+    elapsed.start();
+
+    // Parents first: reloading one may release or rebuild its submenus,
+    // which then cancel their own pending reload.
+    QVector<QPair<int, Update>> updates;
+    updates.reserve(m_pending.count());
+    for (auto it = m_pending.constBegin(); it != m_pending.constEnd(); ++it) {
+        updates << qMakePair(it.key().first->menuDepth(it.key().second), it.key());
+    }
+    std::stable_sort(updates.begin(), updates.end(), [](const QPair<int, Update> &a, const QPair<int, Update> &b) {
+        return a.first < b.first;
+    });
+
+    int reloaded = 0;
+    for (const QPair<int, Update> &update : updates) {
+        auto pending = m_pending.find(update.second);
+        if (pending == m_pending.end()) continue;
+        const int causes = pending.value();
+        m_pending.erase(pending);
+
+        UnityPlatformMenu *menu = update.second.second;
+        UNITY_TRACE2(reload_start, quint64(menu->tag()), causes);
+        update.second.first->reloadMenu(menu);
+        UNITY_TRACE2(reload_end, quint64(menu->tag()), causes);
+        ++reloaded;
+
+        if (m_budget > 0 && elapsed.elapsed() >= m_budget && !m_pending.isEmpty()) {
+            // Let the event loop breathe, the rest is reloaded right after
+            m_flushTimer.start(0);
+            break;
+        }
+    }
+
+    qCDebug(unityappmenu, "UnityMenuUpdateScheduler::flush(reloaded=%d, pending=%d, elapsed=%lld ms)",
+            reloaded, m_pending.count(), elapsed.elapsed());
+}
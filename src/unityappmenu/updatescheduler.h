@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2016 Canonical, Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UNITY_MENU_UPDATE_SCHEDULER_H
+#define UNITY_MENU_UPDATE_SCHEDULER_H
+
+#include <QHash>
+#include <QObject>
+#include <QPair>
+#include <QTimer>
+#include <QVector>
+
+class UnityGMenuModelExporter;
+class UnityPlatformMenu;
+
+// The changes that made a menu need a reload, combined when collected together
+enum UnityMenuReloadCause {
+    CauseItemInserted = 0x1,
+    CauseItemRemoved = 0x2,
+    CauseEnabledChanged = 0x4,
+    CauseVisibleChanged = 0x8,
+    CauseSeparatorChanged = 0x10
+};
+
+// Reloads the menus whose structure changed, for all the exporters of the process.
+// Changes are collected during a debounce window (QTUNITY_MENU_UPDATE_DEBOUNCE,
+// in ms, 0 by default) and flushed at once, parent menus before their submenus.
+// A flush stops once it took longer than its budget (QTUNITY_MENU_UPDATE_BUDGET,
+// in ms, unlimited by default) and the rest is reloaded in the next iteration.
+class UnityMenuUpdateScheduler : public QObject
+{
+    Q_OBJECT
+public:
+    static UnityMenuUpdateScheduler *instance();
+
+    void schedule(UnityGMenuModelExporter *exporter, UnityPlatformMenu *menu, UnityMenuReloadCause cause);
+    // Drop a pending reload, the menu is gone or was just built from scratch
+    void cancel(UnityGMenuModelExporter *exporter, UnityPlatformMenu *menu);
+    void cancelAll(UnityGMenuModelExporter *exporter);
+
+private:
+    typedef QPair<UnityGMenuModelExporter*, UnityPlatformMenu*> Update;
+
+    UnityMenuUpdateScheduler();
+
+    void flush();
+
+    QTimer m_flushTimer;
+    int m_debounce;
+    int m_budget;
+    // Pending reloads -> their UnityMenuReloadCause flags
+    QHash<Update, int> m_pending;
+};
+
+#endif // UNITY_MENU_UPDATE_SCHEDULER_H
@@ -0,0 +1,571 @@
+/*
+ * Copyright (C) 2016 Canonical, Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Benchmarks of the menu exporter hot paths.
+//
+// Synthetic menu bars are exported on a private dbus-daemon and read by a
+// consumer living in its own thread, like the shell would. Besides the time
+// reported by QBENCHMARK, every benchmark logs how much the heap grew, from
+// mallinfo, and the bytes the exporter put on the wire per iteration.
+//
+// memoryPerItem reports the heap used per menu entry, by the platform menus
+// and by their export. rebuildConnections and destroyItem check the exporter
+// stays sound over the changes benchmarked.
+//
+// The trees are W menus of W items, nested D levels deep, and are selected
+// with QTUNITY_BENCHMARK_TREE=WxD, e.g. QTUNITY_BENCHMARK_TREE=30x2.
+// No display is needed, the offscreen platform is used unless told otherwise.
+
+// Local
+#include "gmenumodelplatformmenu.h"
+#include "dbusworker.h"
+#include "exportercounters.h"
+#include "gmenumodelexporter.h"
+#include "sessionbus.h"
+#include "menutree.h"
+
+#include <QtTest>
+#include <QAbstractEventDispatcher>
+#include <QGuiApplication>
+
+#include <atomic>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include <gio/gio.h>
+
+namespace {
+
+std::atomic<qint64> s_wireBytes(0);
+std::atomic<qint64> s_wireMessages(0);
+
+GDBusMessage *count_outgoing_cb(GDBusConnection *, GDBusMessage *message, gboolean incoming, gpointer)
+{
+    if (!incoming) {
+        gsize size = 0;
+        guchar *blob = g_dbus_message_to_blob(message, &size, G_DBUS_CAPABILITY_FLAGS_NONE, nullptr);
+        if (blob) {
+            s_wireBytes += size;
+            ++s_wireMessages;
+            g_free(blob);
+        }
+    }
+    return message;
+}
+
+// Bytes currently allocated on the heap, -1 if unknown
+qint64 heapInUse()
+{
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 33)
+    const struct mallinfo2 info = mallinfo2();
+    return qint64(info.uordblks) + qint64(info.hblkhd);
+#elif defined(__GLIBC__)
+    const struct mallinfo info = mallinfo();
+    return qint64(info.uordblks) + qint64(info.hblkhd);
+#else
+    return -1;
+#endif
+}
+
+// Run everything that's pending in the GUI thread and wait for what it sent
+// to be written out.
+void settle()
+{
+    QAbstractEventDispatcher *dispatcher = QAbstractEventDispatcher::instance();
+    while (dispatcher->processEvents(QEventLoop::AllEvents)) {}
+
+    if (UnityDBusWorker::instance()) {
+        UnityDBusWorker::instance()->invokeAndWait([]() {});
+    }
+    g_dbus_connection_flush_sync(UnitySessionBus::instance()->connection(), nullptr, nullptr);
+}
+
+// Heap growth and wire traffic over a number of benchmark iterations
+class Metrics
+{
+public:
+    Metrics()
+        : m_iterations(0)
+        , m_heap(heapInUse())
+        , m_wireBytes(s_wireBytes)
+        , m_wireMessages(s_wireMessages)
+    {}
+
+    ~Metrics()
+    {
+        if (m_iterations == 0) return;
+
+        const double iterations = m_iterations;
+        const qint64 heap = heapInUse();
+        qInfo("%s: %.1f bytes more on the heap, %.1f bytes in %.1f messages on the wire per iteration",
+              QTest::currentDataTag(),
+              (m_heap < 0 || heap < 0) ? 0.0 : (heap - m_heap) / iterations,
+              (s_wireBytes - m_wireBytes) / iterations,
+              (s_wireMessages - m_wireMessages) / iterations);
+    }
+
+    void iteration() { ++m_iterations; }
+
+private:
+    int m_iterations;
+    qint64 m_heap;
+    qint64 m_wireBytes;
+    qint64 m_wireMessages;
+};
+
+// Reads an exported menu from its own thread and connection, subscribing to
+// every submenu it finds like the shell showing all of them would.
+class MenuConsumer
+{
+public:
+    MenuConsumer(const QByteArray &address)
+        : m_connection(nullptr)
+        , m_root(nullptr)
+    {
+        m_thread.invokeAndWait([this, address]() {
+            GError *error = nullptr;
+            m_connection = g_dbus_connection_new_for_address_sync(address.constData(),
+                                                                  GDBusConnectionFlags(G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                                                                                       G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION),
+                                                                  nullptr, nullptr, &error);
+            if (!m_connection) {
+                qWarning("Failed to connect the menu consumer - %s", error ? error->message : "unknown error");
+                g_clear_error(&error);
+            }
+        });
+    }
+
+    ~MenuConsumer()
+    {
+        m_thread.invokeAndWait([this]() {
+            unsubscribe();
+            if (m_connection) {
+                g_dbus_connection_close_sync(m_connection, nullptr, nullptr);
+                g_object_unref(m_connection);
+            }
+        });
+    }
+
+    // Read the menu until all of its entries arrived, letting the GUI thread
+    // answer the subscriptions meanwhile.
+    bool readAll(const QString &busName, const QString &path, int entries, int timeout = 60000)
+    {
+        m_thread.invokeAndWait([this, busName, path]() {
+            unsubscribe();
+            if (m_connection) {
+                m_root = G_MENU_MODEL(g_dbus_menu_model_get(m_connection,
+                                                            busName.toUtf8().constData(),
+                                                            path.toUtf8().constData()));
+            }
+        });
+
+        QElapsedTimer elapsed;
+        elapsed.start();
+        int read = 0;
+        while (elapsed.elapsed() < timeout) {
+            settle();
+            m_thread.invokeAndWait([this, &read]() {
+                read = m_root ? readMenu(m_root) : 0;
+            });
+            if (read == entries) return true;
+            QThread::usleep(100);
+        }
+        qWarning("Read %d of %d menu entries", read, entries);
+        return false;
+    }
+
+private:
+    // Number of entries read so far. Reading the items of a proxy model
+    // subscribes to it, so every model found is kept to stay subscribed.
+    int readMenu(GMenuModel *model)
+    {
+        const int count = g_menu_model_get_n_items(model);
+        int entries = count;
+        for (int i = 0; i < count; ++i) {
+            GMenuLinkIter *links = g_menu_model_iterate_item_links(model, i);
+            const gchar *name = nullptr;
+            GMenuModel *link = nullptr;
+            while (g_menu_link_iter_get_next(links, &name, &link)) {
+                if (!m_models.contains(link)) {
+                    m_models.insert(link);
+                    g_object_ref(link);
+                }
+                // Sections aren't entries by themselves
+                if (g_strcmp0(name, G_MENU_LINK_SECTION) == 0) {
+                    --entries;
+                }
+                entries += readMenu(link);
+                g_object_unref(link);
+            }
+            g_object_unref(links);
+        }
+        return entries;
+    }
+
+    void unsubscribe()
+    {
+        Q_FOREACH(GMenuModel *model, m_models) {
+            g_object_unref(model);
+        }
+        m_models.clear();
+        if (m_root) {
+            g_object_unref(m_root);
+            m_root = nullptr;
+        }
+    }
+
+    // A worker of its own, standing in for the shell process
+    UnityDBusWorker m_thread;
+    GDBusConnection *m_connection;
+    GMenuModel *m_root;
+    QSet<GMenuModel*> m_models;
+};
+
+// An item telling how many slots its signals are connected to
+class CountedItem : public UnityPlatformMenuItem
+{
+public:
+    int receiverCount() const
+    {
+        return receivers(SIGNAL(destroyed(QObject*))) +
+               receivers(SIGNAL(checkedChanged(bool))) +
+               receivers(SIGNAL(enabledChanged(bool))) +
+               receivers(SIGNAL(visibleChanged(bool))) +
+               receivers(SIGNAL(separatorChanged(bool))) +
+               receivers(SIGNAL(propertyChanged(int)));
+    }
+};
+
+} // namespace
+
+class ExporterBenchmark : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void initTestCase();
+    void cleanupTestCase();
+
+    void initialExport_data() { trees(); }
+    void initialExport();
+    void insertItem_data() { trees(); }
+    void insertItem();
+    void changeLabel_data() { trees(); }
+    void changeLabel();
+    void toggleVisible_data() { trees(); }
+    void toggleVisible();
+    void toggleEnabled_data() { trees(); }
+    void toggleEnabled();
+    void teardown_data() { trees(); }
+    void teardown();
+
+    void memoryPerItem_data() { trees(); }
+    void memoryPerItem();
+
+    void rebuildConnections();
+    void destroyItem();
+
+private:
+    void trees();
+    bool exportAndRead(MenuTree &tree);
+
+    GTestDBus *m_testBus = nullptr;
+    guint m_filter = 0;
+    QScopedPointer<MenuConsumer> m_consumer;
+};
+
+void ExporterBenchmark::initTestCase()
+{
+    gchar *daemon = g_find_program_in_path("dbus-daemon");
+    if (!daemon) {
+        QSKIP("dbus-daemon is needed to run the benchmarks");
+    }
+    g_free(daemon);
+
+    // The session bus of the exporters is the private one from now on
+    m_testBus = g_test_dbus_new(G_TEST_DBUS_NONE);
+    g_test_dbus_up(m_testBus);
+
+    UnitySessionBus::instance()->acquire();
+    QTRY_VERIFY_WITH_TIMEOUT(UnitySessionBus::instance()->connection() != nullptr, 10000);
+    m_filter = g_dbus_connection_add_filter(UnitySessionBus::instance()->connection(),
+                                            count_outgoing_cb, nullptr, nullptr);
+
+    m_consumer.reset(new MenuConsumer(g_test_dbus_get_bus_address(m_testBus)));
+}
+
+void ExporterBenchmark::cleanupTestCase()
+{
+    if (!m_testBus) return;
+
+    m_consumer.reset();
+    if (m_filter) {
+        g_dbus_connection_remove_filter(UnitySessionBus::instance()->connection(), m_filter);
+    }
+
+    // The shared connection outlives the benchmarks, don't wait for it to go away
+    g_test_dbus_stop(m_testBus);
+    g_object_unref(m_testBus);
+}
+
+void ExporterBenchmark::trees()
+{
+    QTest::addColumn<int>("width");
+    QTest::addColumn<int>("depth");
+
+    const QByteArray tree = qgetenv("QTUNITY_BENCHMARK_TREE");
+    if (!tree.isEmpty()) {
+        const QList<QByteArray> size = tree.split('x');
+        QTest::newRow(tree.constData()) << size.value(0).toInt() << qMax(size.value(1).toInt(), 1);
+        return;
+    }
+
+    QTest::newRow("10x1") << 10 << 1;
+    QTest::newRow("10x2") << 10 << 2;
+    QTest::newRow("100x1") << 100 << 1;
+    QTest::newRow("30x2") << 30 << 2;
+}
+
+// Export a tree and wait for the consumer to have read all of it
+bool ExporterBenchmark::exportAndRead(MenuTree &tree)
+{
+    tree.exportBar();
+    const bool read = m_consumer->readAll(UnitySessionBus::instance()->uniqueName(),
+                                          tree.bar()->exportedPath(), tree.entryCount());
+    settle();
+    return read;
+}
+
+// Building the models and sending all of them to a consumer subscribed to every menu
+void ExporterBenchmark::initialExport()
+{
+    QFETCH(int, width);
+    QFETCH(int, depth);
+    MenuTree tree(width, depth);
+
+    Metrics metrics;
+    QBENCHMARK_ONCE {
+        QVERIFY(exportAndRead(tree));
+        metrics.iteration();
+    }
+}
+
+void ExporterBenchmark::insertItem()
+{
+    QFETCH(int, width);
+    QFETCH(int, depth);
+    MenuTree tree(width, depth);
+    QVERIFY(exportAndRead(tree));
+
+    UnityPlatformMenu *menu = tree.middleMenu();
+    int inserted = 0;
+
+    Metrics metrics;
+    QBENCHMARK {
+        UnityPlatformMenuItem *item = tree.createItem(QStringLiteral("Inserted %1").arg(inserted++));
+        menu->insertMenuItem(item, menu->menuItemAt(width / 2));
+        settle();
+        metrics.iteration();
+    }
+}
+
+void ExporterBenchmark::changeLabel()
+{
+    QFETCH(int, width);
+    QFETCH(int, depth);
+    MenuTree tree(width, depth);
+    QVERIFY(exportAndRead(tree));
+
+    UnityPlatformMenuItem *item = tree.middleItem();
+    int changes = 0;
+
+    Metrics metrics;
+    QBENCHMARK {
+        item->setText(QStringLiteral("Changed %1").arg(changes++));
+        settle();
+        metrics.iteration();
+    }
+}
+
+void ExporterBenchmark::toggleVisible()
+{
+    QFETCH(int, width);
+    QFETCH(int, depth);
+    MenuTree tree(width, depth);
+    QVERIFY(exportAndRead(tree));
+
+    UnityPlatformMenuItem *item = tree.middleItem();
+    bool visible = true;
+
+    Metrics metrics;
+    QBENCHMARK {
+        visible = !visible;
+        item->setVisible(visible);
+        settle();
+        metrics.iteration();
+    }
+}
+
+void ExporterBenchmark::toggleEnabled()
+{
+    QFETCH(int, width);
+    QFETCH(int, depth);
+    MenuTree tree(width, depth);
+    QVERIFY(exportAndRead(tree));
+
+    UnityPlatformMenuItem *item = tree.middleItem();
+    bool enabled = true;
+
+    Metrics metrics;
+    QBENCHMARK {
+        enabled = !enabled;
+        item->setEnabled(enabled);
+        settle();
+        metrics.iteration();
+    }
+}
+
+// Unexporting and releasing the models of a tree read by a consumer
+void ExporterBenchmark::teardown()
+{
+    QFETCH(int, width);
+    QFETCH(int, depth);
+    MenuTree tree(width, depth);
+    QVERIFY(exportAndRead(tree));
+
+    Metrics metrics;
+    QBENCHMARK_ONCE {
+        tree.destroyBar();
+        settle();
+        metrics.iteration();
+    }
+}
+
+// Heap used per entry by a tree of platform menus, then by its exported models,
+// actions and records. Nobody reads the menus, so that only the exporter counts.
+void ExporterBenchmark::memoryPerItem()
+{
+    QFETCH(int, width);
+    QFETCH(int, depth);
+
+    settle();
+    const qint64 start = heapInUse();
+    if (start < 0) {
+        QSKIP("The heap usage can't be read with this C library");
+    }
+
+    MenuTree tree(width, depth);
+    tree.createBar();
+    const qint64 built = heapInUse();
+
+    tree.exportBar();
+    settle();
+    const qint64 exported = heapInUse();
+
+    const double menuBytes = double(built - start) / tree.entryCount();
+    const double exportBytes = double(exported - built) / tree.entryCount();
+    qInfo("%d entries: %.0f bytes per item, %.0f more per exported item",
+          tree.entryCount(), menuBytes, exportBytes);
+    QTest::setBenchmarkResult(menuBytes + exportBytes, QTest::BytesAllocated);
+}
+
+// Reloading a menu over and over must not connect to its items again
+void ExporterBenchmark::rebuildConnections()
+{
+    MenuTree tree(10, 2);
+    QVERIFY(exportAndRead(tree));
+
+    UnityExporterCounters *counters = UnityExporterCounters::process();
+    UnityPlatformMenu *menu = tree.middleMenu();
+    QPlatformMenuItem *before = menu->menuItemAt(menu->menuItems().indexOf(tree.middleItem()) + 1);
+
+    QScopedPointer<CountedItem> item(new CountedItem());
+    item->setText(QStringLiteral("Counted"));
+    menu->insertMenuItem(item.data(), before);
+    settle();
+
+    const int receivers = item->receiverCount();
+    const qint64 connections = counters->value(UnityExporterCounters::PropertyConnections);
+    const qint64 reloads = counters->value(UnityExporterCounters::Reloads);
+    QVERIFY(receivers > 0);
+
+    for (int i = 0; i < 1000; ++i) {
+        menu->removeMenuItem(item.data());
+        settle();
+        menu->insertMenuItem(item.data(), before);
+        settle();
+    }
+
+    QVERIFY(counters->value(UnityExporterCounters::Reloads) - reloads >= 1000);
+    QCOMPARE(item->receiverCount(), receivers);
+    QCOMPARE(counters->value(UnityExporterCounters::PropertyConnections), connections);
+
+    menu->removeMenuItem(item.data());
+    settle();
+}
+
+// An item destroyed right after being removed from its menu, as Qt does, must
+// be gone from the exported model before the menu is reloaded.
+void ExporterBenchmark::destroyItem()
+{
+    MenuTree tree(10, 1);
+    UnityPlatformMenu *menu = tree.middleMenu();
+    UnityMenuExporter exporter(menu);
+    settle();
+
+    UnityPlatformMenuItem *item = tree.middleItem();
+    menu->removeMenuItem(item);
+    delete item;
+
+    // Reads every entry of the exported models
+    GVariant *snapshot = exporter.snapshot();
+    guint64 rootId;
+    GVariant *models;
+    g_variant_get(snapshot, "(t@a{ta(a{sv}a{st})}@at@a{s(bmv)}@as)", &rootId, &models, nullptr, nullptr, nullptr);
+
+    int entries = -1;
+    GVariantIter iter;
+    guint64 id;
+    GVariant *items;
+    g_variant_iter_init(&iter, models);
+    while (g_variant_iter_next(&iter, "{t@a(a{sv}a{st})}", &id, &items)) {
+        if (id == rootId) {
+            entries = g_variant_n_children(items);
+        }
+        g_variant_unref(items);
+    }
+    g_variant_unref(models);
+    g_variant_unref(snapshot);
+
+    QCOMPARE(entries, 9);
+    settle();
+}
+
+int main(int argc, char *argv[])
+{
+    // Platform menus and the registrar need a QGuiApplication, not a display
+    if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM")) {
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    }
+    QGuiApplication app(argc, argv);
+
+    ExporterBenchmark benchmark;
+    return QTest::qExec(&benchmark, argc, argv);
+}
+
+#include "exporterbenchmark.moc"
@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2016 Canonical, Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MENUTREE_H
+#define MENUTREE_H
+
+#include "gmenumodelplatformmenu.h"
+
+#include <QObject>
+#include <QScopedPointer>
+#include <QVector>
+
+// A synthetic menu bar: width menus of width items, the items of the
+// first depth - 1 levels opening a submenu of their own.
+class MenuTree
+{
+public:
+    MenuTree(int width, int depth)
+        : m_width(width)
+        , m_entries(0)
+    {
+        for (int i = 0; i < width; ++i) {
+            m_menus << buildMenu(QStringLiteral("Menu %1").arg(i), depth);
+            ++m_entries;
+        }
+    }
+
+    ~MenuTree()
+    {
+        destroyBar();
+    }
+
+    // A new bar holding all the menus, not exported until reparented
+    void createBar()
+    {
+        m_bar.reset(new UnityPlatformMenuBar());
+        Q_FOREACH(UnityPlatformMenu *menu, m_menus) {
+            m_bar->insertMenu(menu, nullptr);
+        }
+    }
+
+    void exportBar(QWindow *window = nullptr)
+    {
+        if (!m_bar) {
+            createBar();
+        }
+        m_bar->handleReparent(window);
+    }
+
+    void destroyBar()
+    {
+        m_bar.reset();
+    }
+
+    UnityPlatformMenuBar *bar() const { return m_bar.data(); }
+
+    // Entries exported by the whole tree, top level menus included
+    int entryCount() const { return m_entries; }
+
+    // The leaf menu in the middle of the tree, and the item in its middle
+    UnityPlatformMenu *middleMenu() const
+    {
+        UnityPlatformMenu *menu = m_menus.at(m_width / 2);
+        while (true) {
+            auto item = static_cast<UnityPlatformMenuItem*>(menu->menuItemAt(m_width / 2));
+            if (!item->menu()) return menu;
+            menu = static_cast<UnityPlatformMenu*>(item->menu());
+        }
+    }
+
+    UnityPlatformMenuItem *middleItem() const
+    {
+        return static_cast<UnityPlatformMenuItem*>(middleMenu()->menuItemAt(m_width / 2));
+    }
+
+    UnityPlatformMenuItem *createItem(const QString &text)
+    {
+        UnityPlatformMenuItem *item = new UnityPlatformMenuItem();
+        item->setParent(&m_objects);
+        item->setText(text);
+        return item;
+    }
+
+private:
+    UnityPlatformMenu *buildMenu(const QString &text, int levels)
+    {
+        UnityPlatformMenu *menu = new UnityPlatformMenu();
+        menu->setParent(&m_objects);
+        menu->setText(text);
+
+        for (int i = 0; i < m_width; ++i) {
+            UnityPlatformMenuItem *item = createItem(QStringLiteral("%1 / Item %2").arg(text).arg(i));
+            if (levels > 1) {
+                item->setMenu(buildMenu(QStringLiteral("%1 / Menu %2").arg(text).arg(i), levels - 1));
+            }
+            menu->insertMenuItem(item, nullptr);
+            ++m_entries;
+        }
+        return menu;
+    }
+
+    int m_width;
+    int m_entries;
+    // Owns the platform menus and items, deleted after the bar
+    QObject m_objects;
+    QVector<UnityPlatformMenu*> m_menus;
+    QScopedPointer<UnityPlatformMenuBar> m_bar;
+};
+
+#endif // MENUTREE_H
@@ -0,0 +1,28 @@
+TARGET = menulatency
+TEMPLATE = app
+
+QT += core-private gui theme_support-private dbus testlib
+
+CONFIG += no_keywords
+CONFIG -= app_bundle
+
+# CONFIG += c++11 # only enables C++0x
+QMAKE_CXXFLAGS += -std=c++11 -Werror -Wall
+QMAKE_LFLAGS += -std=c++11 -Wl,-no-undefined
+
+CONFIG += link_pkgconfig
+PKGCONFIG += gio-2.0
+
+# The plugin is built in, so that its internals can be driven directly
+PLUGIN_DIR = ../../src/unityappmenu
+INCLUDEPATH += ../common
+include($$PLUGIN_DIR/unityappmenu.pri)
+
+# The stand-in registrar implements the interface the plugin calls
+DEFINES += REGISTRAR_XML=\\\"$$PWD/$$PLUGIN_DIR/io.unity8.MenuRegistrar.xml\\\"
+
+HEADERS += \
+    ../common/menutree.h
+
+SOURCES += \
+    menulatency.cpp
@@ -0,0 +1,556 @@
+/*
+ * Copyright (C) 2016 Canonical, Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranties of MERCHANTABILITY,
+ * SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// End to end latencies of the menus, as the shell sees them.
+//
+// A stand-in for the shell runs in its own thread and connection on a private
+// dbus-daemon. It implements io.unity8.MenuRegistrar from the interface
+// description the plugin is built with, mirrors the menu registered with it
+// through g_dbus_menu_model_get and timestamps every change it receives.
+//
+// Over QTUNITY_LATENCY_SAMPLES runs (20 by default), it reports the time from
+//  - handleReparent to a fully mirrored menu bar,
+//  - setText and insertMenuItem to the shell seeing the new label,
+//  - the shell activating an action to QPlatformMenuItem::activated.
+// The menu bar is sized with QTUNITY_BENCHMARK_TREE=WxD, 10x2 by default.
+// No display is needed, the offscreen platform is used unless told otherwise.
+
+// Local
+#include "gmenumodelplatformmenu.h"
+#include "dbusworker.h"
+#include "registry.h"
+#include "sessionbus.h"
+#include "menutree.h"
+
+#include <QtTest>
+#include <QGuiApplication>
+#include <QWindow>
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+
+#include <gio/gio.h>
+
+#define REGISTRAR_SERVICE "io.unity8.MenuRegistrar"
+#define REGISTRY_OBJECT_PATH "/io/unity8/MenuRegistrar"
+#define REGISTRAR_INTERFACE "io.unity8.MenuRegistrar"
+
+namespace {
+
+const int timeout = 10000;
+
+int samples()
+{
+    bool ok;
+    const int value = qEnvironmentVariableIntValue("QTUNITY_LATENCY_SAMPLES", &ok);
+    return ok && value > 0 ? value : 20;
+}
+
+// Run the GUI thread until the condition holds, as fast as possible so that
+// waiting doesn't add to the latencies.
+bool spinUntil(std::function<bool()> condition)
+{
+    QElapsedTimer elapsed;
+    elapsed.start();
+    while (!condition()) {
+        if (elapsed.elapsed() > timeout) return false;
+        QCoreApplication::processEvents(QEventLoop::AllEvents);
+        QThread::yieldCurrentThread();
+    }
+    return true;
+}
+
+void report(const char *what, QVector<qint64> latencies)
+{
+    if (latencies.isEmpty()) return;
+
+    std::sort(latencies.begin(), latencies.end());
+    const double median = latencies.at(latencies.count() / 2) / 1000.0;
+    qInfo("%s: min %.2f ms, median %.2f ms, max %.2f ms over %d samples", what,
+          latencies.first() / 1000.0, median, latencies.last() / 1000.0, latencies.count());
+    QTest::setBenchmarkResult(median, QTest::WalltimeMilliseconds);
+}
+
+// Stands in for the shell: the registrar the menus get registered with, and
+// their consumer. Everything but the waiting runs in its own thread.
+class ShellStandIn
+{
+public:
+    ShellStandIn(const QByteArray &address)
+        : m_connection(nullptr)
+        , m_nodeInfo(nullptr)
+        , m_registrationId(0)
+        , m_ownerId(0)
+        , m_root(nullptr)
+        , m_actions(nullptr)
+        , m_satisfiedAt(0)
+    {
+        m_thread.invokeAndWait([this, address]() {
+            startRegistrar(address);
+        });
+    }
+
+    ~ShellStandIn()
+    {
+        m_thread.invokeAndWait([this]() {
+            unfollow();
+            if (m_ownerId) {
+                g_bus_unown_name(m_ownerId);
+            }
+            if (m_registrationId) {
+                g_dbus_connection_unregister_object(m_connection, m_registrationId);
+            }
+            g_clear_pointer(&m_nodeInfo, g_dbus_node_info_unref);
+            if (m_connection) {
+                g_dbus_connection_close_sync(m_connection, nullptr, nullptr);
+                g_object_unref(m_connection);
+            }
+        });
+    }
+
+    bool isRegistrar() const { return m_ownerId != 0; }
+
+    // Monotonic time of the first change after which the mirrored menu
+    // satisfies the condition, evaluated in the shell thread. 0 on timeout.
+    qint64 waitFor(std::function<bool(ShellStandIn*)> condition)
+    {
+        m_thread.invokeAndWait([this, condition]() {
+            m_satisfiedAt = 0;
+            m_condition = condition;
+            checkCondition(g_get_monotonic_time());
+        });
+
+        spinUntil([this]() { return m_satisfiedAt != 0; });
+
+        m_thread.invokeAndWait([this]() {
+            m_condition = nullptr;
+        });
+        return m_satisfiedAt;
+    }
+
+    // Activate the action of the item with the given label, like a click in the
+    // shell. Returns the monotonic time the activation was sent at, 0 if the
+    // item wasn't found.
+    qint64 activate(const QString &label)
+    {
+        qint64 sentAt = 0;
+        m_thread.invokeAndWait([this, label, &sentAt]() {
+            const QByteArray action = findAttribute(label, G_MENU_ATTRIBUTE_ACTION);
+            if (!m_actions || !action.startsWith("unity.")) return;
+
+            sentAt = g_get_monotonic_time();
+            g_action_group_activate_action(m_actions, action.mid(6).constData(), nullptr);
+        });
+        return sentAt;
+    }
+
+    // Conditions, only called from the shell thread
+    bool isMirrored(const QString &path, int entries)
+    {
+        return m_path == path.toUtf8() && m_root && readMenu(m_root) == entries;
+    }
+
+    bool hasLabel(const QString &label)
+    {
+        return !findAttribute(label, G_MENU_ATTRIBUTE_LABEL).isNull();
+    }
+
+private:
+    void startRegistrar(const QByteArray &address)
+    {
+        GError *error = nullptr;
+        m_connection = g_dbus_connection_new_for_address_sync(address.constData(),
+                                                              GDBusConnectionFlags(G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                                                                                   G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION),
+                                                              nullptr, nullptr, &error);
+        if (!m_connection) {
+            qWarning("Failed to connect the shell - %s", error ? error->message : "unknown error");
+            g_clear_error(&error);
+            return;
+        }
+
+        gchar *xml = nullptr;
+        if (!g_file_get_contents(REGISTRAR_XML, &xml, nullptr, &error) ||
+            !(m_nodeInfo = g_dbus_node_info_new_for_xml(xml, &error))) {
+            qWarning("Failed to read the registrar interface - %s", error ? error->message : "unknown error");
+            g_clear_error(&error);
+            g_free(xml);
+            return;
+        }
+        g_free(xml);
+
+        static const GDBusInterfaceVTable vtable = { registrar_method_cb, nullptr, nullptr, nullptr };
+        m_registrationId = g_dbus_connection_register_object(m_connection, REGISTRY_OBJECT_PATH,
+                                                             g_dbus_node_info_lookup_interface(m_nodeInfo, REGISTRAR_INTERFACE),
+                                                             &vtable, this, nullptr, &error);
+        if (!m_registrationId) {
+            qWarning("Failed to export the registrar - %s", error ? error->message : "unknown error");
+            g_clear_error(&error);
+            return;
+        }
+        m_ownerId = g_bus_own_name_on_connection(m_connection, REGISTRAR_SERVICE, G_BUS_NAME_OWNER_FLAGS_NONE,
+                                                 nullptr, nullptr, nullptr, nullptr);
+    }
+
+    static void registrar_method_cb(GDBusConnection *, const gchar *, const gchar *, const gchar *,
+                                    const gchar *method, GVariant *parameters,
+                                    GDBusMethodInvocation *invocation, gpointer user_data)
+    {
+        auto shell = static_cast<ShellStandIn*>(user_data);
+        const gchar *path = nullptr;
+        const gchar *service = nullptr;
+
+        if (g_strcmp0(method, "RegisterAppMenu") == 0) {
+            g_variant_get(parameters, "(u&o&o&s)", nullptr, &path, nullptr, &service);
+            shell->follow(service, path);
+        } else if (g_strcmp0(method, "RegisterSurfaceMenu") == 0) {
+            g_variant_get(parameters, "(&s&o&o&s)", nullptr, &path, nullptr, &service);
+            shell->follow(service, path);
+        } else if (g_strcmp0(method, "UnregisterAppMenu") == 0) {
+            g_variant_get(parameters, "(u&o)", nullptr, &path);
+            shell->forget(path);
+        } else if (g_strcmp0(method, "UnregisterSurfaceMenu") == 0) {
+            g_variant_get(parameters, "(&s&o)", nullptr, &path);
+            shell->forget(path);
+        } else if (g_strcmp0(method, "RegisterMenus") == 0) {
+            GVariantIter *appMenus, *surfaceMenus, *unregisteredAppMenus, *unregisteredSurfaceMenus;
+            g_variant_get(parameters, "(a(uoos)a(soos)a(uo)a(so))",
+                          &appMenus, &surfaceMenus, &unregisteredAppMenus, &unregisteredSurfaceMenus);
+            while (g_variant_iter_next(unregisteredAppMenus, "(u&o)", nullptr, &path)) {
+                shell->forget(path);
+            }
+            while (g_variant_iter_next(unregisteredSurfaceMenus, "(&s&o)", nullptr, &path)) {
+                shell->forget(path);
+            }
+            while (g_variant_iter_next(appMenus, "(u&o&o&s)", nullptr, &path, nullptr, &service)) {
+                shell->follow(service, path);
+            }
+            while (g_variant_iter_next(surfaceMenus, "(&s&o&o&s)", nullptr, &path, nullptr, &service)) {
+                shell->follow(service, path);
+            }
+            g_variant_iter_free(appMenus);
+            g_variant_iter_free(surfaceMenus);
+            g_variant_iter_free(unregisteredAppMenus);
+            g_variant_iter_free(unregisteredSurfaceMenus);
+        }
+        g_dbus_method_invocation_return_value(invocation, nullptr);
+    }
+
+    // Mirror the last registered menu, like the shell showing it
+    void follow(const gchar *service, const gchar *path)
+    {
+        unfollow();
+        m_path = path;
+        m_root = G_MENU_MODEL(g_dbus_menu_model_get(m_connection, service, path));
+        m_actions = G_ACTION_GROUP(g_dbus_action_group_get(m_connection, service, path));
+        watch(m_root);
+        checkCondition(g_get_monotonic_time());
+    }
+
+    void forget(const gchar *path)
+    {
+        if (m_path == path) {
+            unfollow();
+        }
+    }
+
+    void unfollow()
+    {
+        for (auto it = m_models.constBegin(); it != m_models.constEnd(); ++it) {
+            g_signal_handler_disconnect(it.key(), it.value());
+            g_object_unref(it.key());
+        }
+        m_models.clear();
+        g_clear_object(&m_root);
+        g_clear_object(&m_actions);
+        m_path.clear();
+    }
+
+    void watch(GMenuModel *model)
+    {
+        if (m_models.contains(model)) return;
+
+        g_object_ref(model);
+        m_models.insert(model, g_signal_connect(model, "items-changed", G_CALLBACK(items_changed_cb), this));
+    }
+
+    static void items_changed_cb(GMenuModel *, gint, gint, gint, gpointer user_data)
+    {
+        static_cast<ShellStandIn*>(user_data)->checkCondition(g_get_monotonic_time());
+    }
+
+    void checkCondition(qint64 changedAt)
+    {
+        // Reading subscribes to the submenus found since
+        if (m_root) {
+            readMenu(m_root);
+        }
+        if (m_condition && m_satisfiedAt == 0 && m_condition(this)) {
+            m_satisfiedAt = changedAt;
+        }
+    }
+
+    // Number of entries mirrored so far, watching every model found
+    int readMenu(GMenuModel *model)
+    {
+        const int count = g_menu_model_get_n_items(model);
+        int entries = count;
+        for (int i = 0; i < count; ++i) {
+            GMenuLinkIter *links = g_menu_model_iterate_item_links(model, i);
+            const gchar *name = nullptr;
+            GMenuModel *link = nullptr;
+            while (g_menu_link_iter_get_next(links, &name, &link)) {
+                watch(link);
+                // Sections aren't entries by themselves
+                if (g_strcmp0(name, G_MENU_LINK_SECTION) == 0) {
+                    --entries;
+                }
+                entries += readMenu(link);
+                g_object_unref(link);
+            }
+            g_object_unref(links);
+        }
+        return entries;
+    }
+
+    // An attribute of the mirrored item with the given label, null if there's none
+    QByteArray findAttribute(const QString &label, const char *attribute)
+    {
+        const QByteArray wanted = label.toUtf8();
+        for (auto it = m_models.constBegin(); it != m_models.constEnd(); ++it) {
+            const int count = g_menu_model_get_n_items(it.key());
+            for (int i = 0; i < count; ++i) {
+                gchar *itemLabel = nullptr;
+                if (!g_menu_model_get_item_attribute(it.key(), i, G_MENU_ATTRIBUTE_LABEL, "s", &itemLabel)) continue;
+
+                const bool found = wanted == itemLabel;
+                g_free(itemLabel);
+                if (!found) continue;
+
+                gchar *value = nullptr;
+                if (!g_menu_model_get_item_attribute(it.key(), i, attribute, "s", &value)) return QByteArray("");
+                const QByteArray result(value);
+                g_free(value);
+                return result;
+            }
+        }
+        return QByteArray();
+    }
+
+    // A worker of its own, standing in for the shell process
+    UnityDBusWorker m_thread;
+    GDBusConnection *m_connection;
+    GDBusNodeInfo *m_nodeInfo;
+    guint m_registrationId;
+    guint m_ownerId;
+
+    QByteArray m_path;
+    GMenuModel *m_root;
+    GActionGroup *m_actions;
+    // Mirrored models (hold a reference) -> their items-changed handler
+    QHash<GMenuModel*, gulong> m_models;
+
+    std::function<bool(ShellStandIn*)> m_condition;
+    std::atomic<qint64> m_satisfiedAt;
+};
+
+} // namespace
+
+class MenuLatency : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void initTestCase();
+    void cleanupTestCase();
+
+    void reparentToMirrored();
+    void labelChange();
+    void itemInsert();
+    void activation();
+
+private:
+    bool exportAndMirror(MenuTree &tree);
+
+    GTestDBus *m_testBus = nullptr;
+    QScopedPointer<ShellStandIn> m_shell;
+    QScopedPointer<QWindow> m_window;
+    int m_width = 10;
+    int m_depth = 2;
+};
+
+void MenuLatency::initTestCase()
+{
+    gchar *daemon = g_find_program_in_path("dbus-daemon");
+    if (!daemon) {
+        QSKIP("dbus-daemon is needed to measure the latencies");
+    }
+    g_free(daemon);
+
+    const QByteArray tree = qgetenv("QTUNITY_BENCHMARK_TREE");
+    if (!tree.isEmpty()) {
+        const QList<QByteArray> size = tree.split('x');
+        m_width = qMax(size.value(0).toInt(), 1);
+        m_depth = qMax(size.value(1).toInt(), 1);
+    }
+
+    // The session bus of the app is the private one from now on
+    m_testBus = g_test_dbus_new(G_TEST_DBUS_NONE);
+    g_test_dbus_up(m_testBus);
+
+    m_shell.reset(new ShellStandIn(g_test_dbus_get_bus_address(m_testBus)));
+    QVERIFY(m_shell->isRegistrar());
+
+    // Menus are registered for a window, which is never shown
+    m_window.reset(new QWindow());
+    QTRY_VERIFY_WITH_TIMEOUT(UnityMenuRegistry::instance()->isConnected(), timeout);
+}
+
+void MenuLatency::cleanupTestCase()
+{
+    if (!m_testBus) return;
+
+    m_window.reset();
+    m_shell.reset();
+
+    // The shared connection outlives the harness, don't wait for it to go away
+    g_test_dbus_stop(m_testBus);
+    g_object_unref(m_testBus);
+}
+
+// Export a tree for the window and wait for the shell to have mirrored it
+bool MenuLatency::exportAndMirror(MenuTree &tree)
+{
+    tree.exportBar(m_window.data());
+    const QString path = tree.bar()->exportedPath();
+    const int entries = tree.entryCount();
+    return m_shell->waitFor([path, entries](ShellStandIn *shell) {
+        return shell->isMirrored(path, entries);
+    }) != 0;
+}
+
+// From handleReparent to the shell having every menu of the bar
+void MenuLatency::reparentToMirrored()
+{
+    MenuTree tree(m_width, m_depth);
+    QVector<qint64> latencies;
+
+    for (int i = 0; i < samples(); ++i) {
+        tree.createBar();
+        const QString path = tree.bar()->exportedPath();
+        const int entries = tree.entryCount();
+
+        const qint64 start = g_get_monotonic_time();
+        tree.exportBar(m_window.data());
+        const qint64 mirrored = m_shell->waitFor([path, entries](ShellStandIn *shell) {
+            return shell->isMirrored(path, entries);
+        });
+        QVERIFY2(mirrored != 0, "The shell didn't mirror the menu bar");
+        latencies << mirrored - start;
+
+        tree.destroyBar();
+    }
+    report("handleReparent to mirrored", latencies);
+}
+
+// From setText to the shell seeing the new label
+void MenuLatency::labelChange()
+{
+    MenuTree tree(m_width, m_depth);
+    QVERIFY(exportAndMirror(tree));
+
+    UnityPlatformMenuItem *item = tree.middleItem();
+    QVector<qint64> latencies;
+
+    for (int i = 0; i < samples(); ++i) {
+        const QString label = QStringLiteral("Changed %1").arg(i);
+
+        const qint64 start = g_get_monotonic_time();
+        item->setText(label);
+        const qint64 shown = m_shell->waitFor([label](ShellStandIn *shell) {
+            return shell->hasLabel(label);
+        });
+        QVERIFY2(shown != 0, "The shell didn't get the new label");
+        latencies << shown - start;
+    }
+    report("setText to visible", latencies);
+}
+
+// From insertMenuItem to the shell seeing the new item
+void MenuLatency::itemInsert()
+{
+    MenuTree tree(m_width, m_depth);
+    QVERIFY(exportAndMirror(tree));
+
+    UnityPlatformMenu *menu = tree.middleMenu();
+    QVector<qint64> latencies;
+
+    for (int i = 0; i < samples(); ++i) {
+        const QString label = QStringLiteral("Inserted %1").arg(i);
+        UnityPlatformMenuItem *item = tree.createItem(label);
+
+        const qint64 start = g_get_monotonic_time();
+        menu->insertMenuItem(item, menu->menuItemAt(0));
+        const qint64 shown = m_shell->waitFor([label](ShellStandIn *shell) {
+            return shell->hasLabel(label);
+        });
+        QVERIFY2(shown != 0, "The shell didn't get the new item");
+        latencies << shown - start;
+    }
+    report("insertMenuItem to visible", latencies);
+}
+
+// From the shell activating an item to QPlatformMenuItem::activated
+void MenuLatency::activation()
+{
+    MenuTree tree(m_width, m_depth);
+    QVERIFY(exportAndMirror(tree));
+
+    const QString label = QStringLiteral("Activated");
+    UnityPlatformMenuItem *item = tree.middleItem();
+    item->setText(label);
+    QVERIFY(m_shell->waitFor([label](ShellStandIn *shell) { return shell->hasLabel(label); }) != 0);
+
+    qint64 activated = 0;
+    connect(item, &QPlatformMenuItem::activated, this, [&activated]() {
+        activated = g_get_monotonic_time();
+    });
+
+    QVector<qint64> latencies;
+    for (int i = 0; i < samples(); ++i) {
+        activated = 0;
+        const qint64 start = m_shell->activate(label);
+        QVERIFY2(start != 0, "The shell didn't find the action of the item");
+        QVERIFY2(spinUntil([&activated]() { return activated != 0; }), "The item wasn't activated");
+        latencies << activated - start;
+    }
+    report("activation to activated", latencies);
+}
+
+int main(int argc, char *argv[])
+{
+    // No shell and no display needed
+    if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM")) {
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    }
+    QGuiApplication app(argc, argv);
+
+    MenuLatency harness;
+    return QTest::qExec(&harness, argc, argv);
+}
+
+#include "menulatency.moc"